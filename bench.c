@@ -0,0 +1,284 @@
+/* codec micro benchmarks
+* dependencies: libpng16.a libz.a
+* To compile: make bench
+* To execute: ./bench <image folder> [repetitions]
+*
+* Times the checksum implementations on their own, then encodes and
+* decodes every image in the folder with zlib's checksums and with the
+* accelerated ones, reporting how much of each image's time the checksums
+* account for, and finally the codec's throughput and IDAT framing
+* overhead at a range of zlib staging buffer sizes, and libpng's
+* allocation counts and time per image with and without the arena.
+*/
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "colorConvert.c"
+
+#define BENCH_BUFFER (1 << 20)
+
+static double bench_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// seconds per byte of the current cc_crc32 and cc_adler32
+static void bench_checksums(const unsigned char* buf, double* crc_cost, double* adler_cost) {
+    const int reps = 200;
+    volatile uLong sink = 0;
+    double t = bench_seconds();
+    for (int i = 0; i < reps; i++)
+        sink += cc_crc32(0, buf, BENCH_BUFFER);
+    *crc_cost = (bench_seconds() - t) / ((double)reps * BENCH_BUFFER);
+    t = bench_seconds();
+    for (int i = 0; i < reps; i++)
+        sink += cc_adler32(1, buf, BENCH_BUFFER);
+    *adler_cost = (bench_seconds() - t) / ((double)reps * BENCH_BUFFER);
+}
+
+typedef struct BenchImage {
+    char name[256];
+    char path[512];
+    png_bytep* rows;
+    png_uint_32 width;
+    png_uint_32 height;
+    size_t file_bytes;
+} BenchImage;
+
+// decodes a whole PNG from fp (positioned at its start) into rows, which
+// are allocated on first use
+static int bench_decode(ConvertContext* ctx, FILE* fp, BenchImage* image) {
+    unsigned char signature[8];
+    png_uint_32 width, height, bit_depth, color_type;
+    if (fread(signature, 1, 8, fp) != 8 || png_sig_cmp(signature, 0, 8) ||
+        native_read_header(ctx, fp, &width, &height, &bit_depth, &color_type))
+        return -1;
+    if (!image->rows) {
+        image->width = width;
+        image->height = height;
+        image->rows = malloc(sizeof(png_bytep) * height);
+        for (png_uint_32 y = 0; y < height; y++)
+            image->rows[y] = malloc((size_t)width * 3);
+    } else if (width != image->width || height != image->height) {
+        return -1;
+    }
+    return native_read_rows(ctx, fp, image->rows, width, height);
+}
+
+static void bench_free(BenchImage* image) {
+    for (png_uint_32 y = 0; image->rows && y < image->height; y++)
+        free(image->rows[y]);
+    free(image->rows);
+    image->rows = NULL;
+}
+
+// loads every image in the folder the native codec can read
+static int bench_load(const char* folder, BenchImage** images) {
+    DIR* dir = opendir(folder);
+    struct dirent* entry;
+    int count = 0;
+    if (!dir) {
+        perror(folder);
+        return -1;
+    }
+    *images = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[512];
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".png") || !strncmp(entry->d_name, "out_", 4))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name);
+        FILE* fp = fopen(path, "rb");
+        if (!fp)
+            continue;
+        BenchImage image = {0};
+        snprintf(image.name, sizeof(image.name), "%s", entry->d_name);
+        snprintf(image.path, sizeof(image.path), "%s", path);
+        if (bench_decode(convert_context(), fp, &image)) {
+            printf("%-40.40s not readable by the native codec\n", entry->d_name);
+            bench_free(&image);
+        } else {
+            fseek(fp, 0, SEEK_END);
+            image.file_bytes = ftell(fp);
+            *images = realloc(*images, (count + 1) * sizeof(**images));
+            (*images)[count++] = image;
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return count;
+}
+
+// times reps encodes of the image into fp and reps decodes of the result;
+// leaves fp holding the encoded file
+static int bench_round_trip(BenchImage* image, FILE* fp, int reps, double* encode, double* decode) {
+    ConvertContext* ctx = convert_context();
+    EncodeOptions opts = native_default_options;
+    int rc = 0;
+    *encode = *decode = 0;
+    for (int r = 0; r < reps && rc == 0; r++) {
+        rewind(fp);
+        double t = bench_seconds();
+        rc = native_write_png(ctx, fp, image->rows, image->width, image->height, &opts);
+        rc |= fflush(fp);
+        *encode += bench_seconds() - t;
+    }
+    for (int r = 0; r < reps && rc == 0; r++) {
+        rewind(fp);
+        double t = bench_seconds();
+        rc = bench_decode(ctx, fp, image);
+        *decode += bench_seconds() - t;
+    }
+    return rc;
+}
+
+typedef struct BenchLibpng {
+    BenchImage* images;
+    int count;
+    int reps;
+} BenchLibpng;
+
+// reads every image with libpng and writes it back out, reps times
+static void* bench_libpng_thread(void* arg) {
+    BenchLibpng* job = arg;
+    ConvertContext* ctx = convert_context();
+    FILE* out = fopen("/dev/null", "wb");
+    for (int r = 0; r < job->reps; r++)
+        for (int i = 0; i < job->count; i++) {
+            FILE* fp = fopen(job->images[i].path, "rb");
+            png_uint_32 width, height, bit_depth, color_type;
+            if (!fp)
+                continue;
+            fseek(fp, 8, SEEK_SET);
+            png_bytep* rows;
+            int rc = libpng_read_png(ctx, &ctx->image, fp, 0, &rows, &width, &height, &bit_depth, &color_type);
+            fclose(fp);
+            if (rc != CONVERT_OK)
+                continue;
+            rewind(out);
+            libpng_write_png(out, rows, width, height, bit_depth, color_type);
+        }
+    fclose(out);
+    return NULL;
+}
+
+// libpng round trips on threads threads, with or without the arena;
+// prints time and allocations per image
+static void bench_libpng(BenchImage* images, int count, int reps, int threads, int arena) {
+    BenchLibpng job = {images, count, reps};
+    pthread_t th[64];
+    convert_arena = arena;
+    convert_png_allocs = convert_png_heap_allocs = 0;
+    double t = bench_seconds();
+    for (int i = 0; i < threads; i++)
+        pthread_create(&th[i], NULL, bench_libpng_thread, &job);
+    for (int i = 0; i < threads; i++)
+        pthread_join(th[i], NULL);
+    t = bench_seconds() - t;
+    double images_done = (double)threads * reps * count;
+    printf("%-7s %7d %14.2f %14.1f %14.2f\n", arena ? "arena" : "malloc", threads, 1e3 * t / images_done,
+           convert_png_allocs / images_done, convert_png_heap_allocs / images_done);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: bench <image folder> [repetitions]\n");
+        return 1;
+    }
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (reps < 1)
+        reps = 1;
+
+    unsigned char* buf = malloc(BENCH_BUFFER);
+    srand(1);
+    for (int i = 0; i < BENCH_BUFFER; i++)
+        buf[i] = (unsigned char)rand();
+    double crc_zlib, adler_zlib, crc_fast, adler_fast;
+    checksum_select(0);
+    bench_checksums(buf, &crc_zlib, &adler_zlib);
+    checksum_select(1);
+    bench_checksums(buf, &crc_fast, &adler_fast);
+    free(buf);
+    printf("crc32:   zlib %7.0f MB/s  %s %7.0f MB/s\n", 1e-6 / crc_zlib, checksum_impl_name, 1e-6 / crc_fast);
+    printf("adler32: zlib %7.0f MB/s  %s %7.0f MB/s\n", 1e-6 / adler_zlib, checksum_impl_name, 1e-6 / adler_fast);
+
+    BenchImage* images;
+    int count = bench_load(argv[1], &images);
+    if (count <= 0)
+        return 1;
+    FILE* tmp = tmpfile();
+    if (!tmp) {
+        perror("tmpfile");
+        return 1;
+    }
+
+    // checksum share of each image's encode and decode
+    printf("\n%-40s %10s %10s %10s %10s %7s\n", "image (ms per pass)", "enc zlib", "enc fast", "dec zlib",
+           "dec fast", "share");
+    for (int i = 0; i < count; i++) {
+        double enc[2], dec[2];
+        int rc = 0;
+        for (int fast = 0; fast < 2 && rc == 0; fast++) {
+            checksum_select(fast);
+            rc = bench_round_trip(&images[i], tmp, reps, &enc[fast], &dec[fast]);
+        }
+        if (rc) {
+            printf("%-40.40s failed\n", images[i].name);
+            continue;
+        }
+        // each pass checksums the file once (crc) and the raw rows once
+        // (adler); the share is that work at zlib's speed over the whole
+        // encode and decode with zlib's checksums
+        size_t raw_bytes = ((size_t)images[i].width * 3 + 1) * images[i].height;
+        double checksum = 2 * (images[i].file_bytes * crc_zlib + raw_bytes * adler_zlib);
+        double total = (dec[0] + enc[0]) / reps;
+        printf("%-40.40s %10.2f %10.2f %10.2f %10.2f %6.1f%%\n", images[i].name, 1e3 * enc[0] / reps,
+               1e3 * enc[1] / reps, 1e3 * dec[0] / reps, 1e3 * dec[1] / reps, 100 * checksum / total);
+    }
+
+    // staging buffer size: throughput over all images (raw bytes per
+    // second) and the chunk framing it costs
+    static const size_t zbuf_sizes[] = {8192, 32768, 262144, 1048576, 0};
+    printf("\n%-12s %12s %12s %10s %14s\n", "zbuf", "enc MB/s", "dec MB/s", "IDATs", "framing bytes");
+    for (size_t k = 0; k < sizeof(zbuf_sizes) / sizeof(zbuf_sizes[0]); k++) {
+        double encode = 0, decode = 0, raw = 0;
+        long chunks = 0;
+        convert_zbuf_size = zbuf_sizes[k];
+        for (int i = 0; i < count; i++) {
+            double enc, dec;
+            if (bench_round_trip(&images[i], tmp, reps, &enc, &dec))
+                continue;
+            ConvertContext* ctx = convert_context();
+            encode += enc;
+            decode += dec;
+            raw += (double)reps * ((size_t)images[i].width * 3 + 1) * images[i].height;
+            chunks += (ctx->encoded_size + ctx->zbuf_size - 1) / ctx->zbuf_size;
+        }
+        char label[16];
+        if (zbuf_sizes[k])
+            snprintf(label, sizeof(label), "%zuk", zbuf_sizes[k] >> 10);
+        else
+            snprintf(label, sizeof(label), "per image");
+        printf("%-12s %12.1f %12.1f %10ld %14ld\n", label, raw / encode / 1e6, raw / decode / 1e6, chunks,
+               12 * chunks);
+    }
+
+    fclose(tmp);
+
+    // libpng's allocations through malloc and through the per-thread arena,
+    // with one thread and with several competing for the allocator
+    printf("\n%-7s %7s %14s %14s %14s\n", "libpng", "threads", "ms per image", "allocs/image",
+           "heap/image");
+    for (int threads = 1; threads <= 8; threads *= 8)
+        for (int arena = 0; arena < 2; arena++)
+            bench_libpng(images, count, reps, threads, arena);
+
+    for (int i = 0; i < count; i++)
+        bench_free(&images[i]);
+    free(images);
+    return 0;
+}
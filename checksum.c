@@ -0,0 +1,216 @@
+/* CRC-32 and Adler-32 for the native PNG codec
+* dependencies: libz.a (scalar fallback)
+* target architecture: x86-64; other targets use zlib's table code
+*
+* PNG chunks carry a CRC-32 and the zlib stream inside IDAT an Adler-32.
+* zlib 1.2.11 computes both a byte (or four) at a time from tables. On CPUs
+* with PCLMULQDQ the CRC is folded 64 bytes per step with carry-less
+* multiplies (Intel, "Fast CRC Computation for Generic Polynomials Using
+* PCLMULQDQ Instruction"), and Adler-32 sums 32 bytes per step with SSSE3.
+* The implementation is picked once at runtime from cpuid.
+*/
+
+#include <stdint.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+#define ADLER_BASE 65521U   // largest prime smaller than 65536
+#define ADLER_NMAX 5552     // most bytes before s2 can overflow 32 bits
+
+static uLong checksum_crc32_zlib(uLong crc, const unsigned char* buf, size_t len) {
+    return crc32(crc, buf, len);
+}
+
+static uLong checksum_adler32_zlib(uLong adler, const unsigned char* buf, size_t len) {
+    return adler32(adler, buf, len);
+}
+
+#ifdef CHECKSUM_X86
+
+// folds whole 16 byte blocks (at least 64 bytes) into the running crc; crc
+// is passed and returned in its non-inverted form
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t checksum_crc32_fold(const unsigned char* buf, size_t len, uint32_t crc) {
+    // bit-reflected fold constants and Barrett reduction constants for the
+    // CRC-32 polynomial 0x04c11db7, from the paper
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = {0x0163cd6124, 0x0000000000};
+    static const uint64_t __attribute__((aligned(16))) poly[] = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // four lanes folded in parallel, 64 bytes per step
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    // fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uLong checksum_crc32_pclmul(uLong crc, const unsigned char* buf, size_t len) {
+    if (len >= 64) {
+        size_t blocks = len & ~(size_t)15;
+        crc = ~checksum_crc32_fold(buf, blocks, ~(uint32_t)crc) & 0xffffffffUL;
+        buf += blocks;
+        len -= blocks;
+    }
+    return len ? crc32(crc, buf, len) : crc;
+}
+
+// Adler-32 over 32 byte blocks: s1 takes the byte sums (psadbw), s2 the
+// position-weighted sums (pmaddubsw against 32..1) plus 32 times the s1 of
+// every earlier block
+__attribute__((target("ssse3")))
+static uLong checksum_adler32_ssse3(uLong adler, const unsigned char* buf, size_t len) {
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = (adler >> 16) & 0xffff;
+    size_t blocks = len / 32;
+    len -= blocks * 32;
+
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (blocks) {
+        // at most NMAX bytes between reductions
+        unsigned n = ADLER_NMAX / 32;
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+        __m128i v_s1 = _mm_setzero_si128();
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i*)buf);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        // horizontal sums
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += _mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_cvtsi128_si32(v_s2);
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    while (len--)
+        s2 += (s1 += *buf++);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+    return s1 | (s2 << 16);
+}
+
+#endif
+
+// the implementations in use; checksum_select() picks them
+uLong (*cc_crc32)(uLong crc, const unsigned char* buf, size_t len) = checksum_crc32_zlib;
+uLong (*cc_adler32)(uLong adler, const unsigned char* buf, size_t len) = checksum_adler32_zlib;
+const char* checksum_impl_name = "zlib";
+
+// selects the fastest implementations the cpu supports, or zlib's table
+// code when accelerated is 0 (used to benchmark one against the other)
+void checksum_select(int accelerated) {
+    cc_crc32 = checksum_crc32_zlib;
+    cc_adler32 = checksum_adler32_zlib;
+    checksum_impl_name = "zlib";
+#ifdef CHECKSUM_X86
+    if (!accelerated)
+        return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        cc_crc32 = checksum_crc32_pclmul;
+    if (__builtin_cpu_supports("ssse3"))
+        cc_adler32 = checksum_adler32_ssse3;
+    if (cc_crc32 != checksum_crc32_zlib && cc_adler32 != checksum_adler32_zlib)
+        checksum_impl_name = "pclmul+ssse3";
+    else if (cc_crc32 != checksum_crc32_zlib)
+        checksum_impl_name = "pclmul";
+    else if (cc_adler32 != checksum_adler32_zlib)
+        checksum_impl_name = "ssse3";
+#endif
+}
+
+__attribute__((constructor))
+static void checksum_init(void) {
+    checksum_select(1);
+}
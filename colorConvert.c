@@ -4,7 +4,7 @@
 * Date: 3/2/2022
 * dependencies: libpng16.a libz.a
 * target architecture: Debian linux kernel
-* To compile: gcc -o colorConvert colorConvert.c libpng16.a libz.a -lm 
+* To compile: gcc -o colorConvert colorConvert.c libpng16.a libz.a -lm
 * To execute: ./colorCovert <input file> <output file>
 * Pre-condition: 8 bit png input file
 * Post-condition: 8 bit png output file in grayscale
@@ -17,8 +17,241 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <zlib.h>
 #include "png.h"
- 
+#include "checksum.c"
+
+// codec used to read and write images. The native codec handles 8 bit RGB
+// non-interlaced files (everything the camera produces) with zlib streams
+// that live as long as the thread does; anything else is read with libpng.
+#define CONVERT_CODEC_NATIVE 0
+#define CONVERT_CODEC_LIBPNG 1
+int convert_codec = CONVERT_CODEC_NATIVE;
+
+// a contiguous image: rows of a fixed stride in one 64 byte aligned block,
+// with the row pointers libpng and the codec take built into it
+typedef struct ConvertBuffer {
+    unsigned char* pixels;
+    size_t size;
+    int mapped;                 // pixels came from mmap rather than malloc
+    int external;               // pixels belong to someone else (a shared
+                                // slot) and are never grown or freed
+    png_bytep* rows;
+    png_uint_32 rows_cap;
+} ConvertBuffer;
+
+// size and format of a decoded image
+typedef struct ConvertImage {
+    png_uint_32 width;
+    png_uint_32 height;
+    png_uint_32 bit_depth;
+    png_uint_32 color_type;
+} ConvertImage;
+
+// bump allocator behind libpng's read and write structs. Everything they
+// allocate for one image comes out of a block the thread keeps and is
+// dropped in one go once the structs are destroyed; requests that do not
+// fit go to malloc and make the block big enough for them next time.
+typedef struct ConvertArena {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+    size_t spilled;             // bytes that did not fit, this image
+    void* spill;                // those allocations, linked through their
+                                // first word
+} ConvertArena;
+
+// per-thread conversion state. Allocated the first time a thread converts an
+// image and kept until the thread exits, so deflate/inflate windows, hash
+// tables and staging buffers are set up once per worker instead of per image.
+typedef struct ConvertContext {
+    z_stream inflater;          // inflate state, inflateReset between images
+    z_stream deflater;          // deflate state, deflateReset between images
+    int inflater_ready;
+    int deflater_ready;
+    unsigned char* zbuf;        // compressed data staging for IDAT in and out
+    size_t zbuf_size;           // size in use for the current image,
+    size_t zbuf_cap;            // and allocated
+    unsigned char* scratch;     // raw filtered rows and a zero "previous" row
+    size_t scratch_size;
+    png_uint_32 idat_left;      // bytes left in the IDAT chunk being read
+    uLong idat_crc;             // running crc of the IDAT chunk being read
+    int deflate_level;          // parameters the deflate stream is set up with
+    int deflate_strategy;
+    int deflate_window;
+    int deflate_mem;
+    size_t encoded_size;        // IDAT payload bytes of the last image encoded
+    uLong adler;                // adler32 of the data being deflated
+    unsigned char* zout;        // whole compressed stream, when it must be
+    size_t zout_size;           // complete before IDAT is written
+    int buffering;
+    z_stream strip_inflater;    // raw inflate for one restart strip
+    int strip_inflater_ready;
+    unsigned char* idat_buf;    // all IDAT data, for strip-parallel decoding
+    size_t idat_buf_size;
+    png_uint_32 restart_rows;   // restart index: rows per strip,
+    png_uint_32 restart_count;  // number of strips,
+    png_uint_32* restart_offsets;   // zlib stream offset of each strip
+    uLong* restart_adler;       // and each strip's adler32 while decoding
+    png_uint_32 restart_cap;
+    ConvertBuffer image;        // the decoded image
+    ConvertBuffer packed[2];    // the optimizer's reduced formats of it
+    ConvertArena arena;         // libpng's allocations
+    char error[256];            // message of the last failed conversion
+    clockid_t cpu_clock;        // the thread's CPU clock, and its reading
+    double cpu_start;           // when the watched conversion started
+    int cancelled;              // set by the watchdog
+} ConvertContext;
+
+// pixel format and compression settings for the native writer
+#define NATIVE_FILTER_ADAPTIVE 5   // pick the best filter per row
+typedef struct EncodeOptions {
+    int bit_depth;
+    int color_type;
+    const unsigned char* palette;  // rgb triples, for palette images
+    int palette_size;
+    int filter;                    // PNG_FILTER_VALUE_* or NATIVE_FILTER_ADAPTIVE
+    int level;
+    int strategy;
+    int window_bits;
+    int mem_level;
+    png_uint_32 restart_rows;      // full flush every this many rows, 0 for none
+} EncodeOptions;
+
+// same stream parameters libpng picks for filtered 8 bit images
+static const EncodeOptions native_default_options = {
+    8, PNG_COLOR_TYPE_RGB, NULL, 0, NATIVE_FILTER_ADAPTIVE,
+    Z_DEFAULT_COMPRESSION, Z_FILTERED, 15, 8, 0
+};
+
+// restart index written into outputs so they can be inflated in parallel
+// strips. "rsIX" is ancillary, private and unsafe to copy (its offsets are
+// meaningless once an editor rewrites the image data), so other readers
+// skip it. Layout: version byte, rows per strip, strip count, then the
+// zlib stream offset of every strip, all big endian. Each strip starts
+// after a full flush and its first row uses filter None or Sub, so it can
+// be inflated and unfiltered without the strips before it.
+#define RESTART_CHUNK "rsIX"
+#define RESTART_VERSION 1
+png_uint_32 convert_restart_rows = 0;
+
+// when set libpng allocates from the thread's arena, otherwise straight
+// from malloc. Either way every allocation is counted, and those that
+// reached malloc are counted again in convert_png_heap_allocs.
+int convert_arena = 1;
+long long convert_png_allocs = 0;
+long long convert_png_heap_allocs = 0;
+
+// backing for the image buffers (--hugepages): ordinary pages from malloc,
+// transparent huge pages asked for with madvise, or 2 MB pages from the
+// hugetlb pool. hugetlb falls back to THP when the pool is empty, and THP
+// is only a hint, so both always end up with usable memory. Buffers can
+// also be prefaulted when allocated and locked into memory.
+#define CONVERT_PAGES_NORMAL 0
+#define CONVERT_PAGES_THP 1
+#define CONVERT_PAGES_HUGETLB 2
+#define CONVERT_HUGE_PAGE (2 * 1024 * 1024)
+int convert_pages = CONVERT_PAGES_NORMAL;
+int convert_prefault = 0;
+int convert_mlock = 0;
+long convert_hugetlb_fallbacks = 0;     // hugetlb requests served by THP
+long convert_mlock_failures = 0;
+
+// when set (--numa-bind) image buffers get a preferred-node policy for the
+// node of the CPU allocating them, and pages already faulted in are moved
+// there. Preferred rather than bound, so a full node spills instead of
+// failing the allocation.
+#define CONVERT_MAX_NODES 1024
+int convert_numa_bind = 0;
+long convert_numa_failures = 0;
+
+// when set, outputs are run through the lossless optimizer
+int convert_optimize = 0;
+
+// encoder degradation under overload, set by driver.c: FAST compresses at
+// zlib's fastest level and skips the optimizer, FASTEST also replaces the
+// per-row filter search with SUB filtering and run-length matching. The
+// outputs are the same images, only bigger.
+#define CONVERT_DEGRADE_NONE 0
+#define CONVERT_DEGRADE_FAST 1
+#define CONVERT_DEGRADE_FASTEST 2
+int convert_degrade = CONVERT_DEGRADE_NONE;
+
+// size of the zlib staging buffers, and so of the IDAT chunks written and
+// of the reads that feed inflate. 0 sizes them per image from its raw data
+// (see convert_zbuf_for); otherwise every image uses this many bytes.
+#define CONVERT_ZBUF_MIN (256 * 1024)
+#define CONVERT_ZBUF_MAX (1024 * 1024)
+size_t convert_zbuf_size = 0;
+
+// result of a conversion. colorConvert, optimizeConvert and the pieces
+// they are built from return one of these rather than aborting, with
+// their files closed and libpng's structs destroyed; the thread's
+// ConvertContext keeps the message of its last failure.
+#define CONVERT_OK 0
+#define CONVERT_ERR_USAGE 1         // bad arguments
+#define CONVERT_ERR_OPEN 2          // input could not be opened or read
+#define CONVERT_ERR_FORMAT 3        // not a PNG, or not an RGB one
+#define CONVERT_ERR_CORRUPT 4       // damaged image data
+#define CONVERT_ERR_MEMORY 5        // out of memory
+#define CONVERT_ERR_WRITE 6         // output could not be written
+#define CONVERT_ERR_TOO_BIG 7       // does not fit an external buffer
+#define CONVERT_ERR_LIMIT 8         // over the image size limits
+#define CONVERT_ERR_TIMEOUT 9       // cancelled by the watchdog
+
+const char* convert_error_name(int code) {
+    static const char* names[] = {"ok", "usage", "open", "format", "corrupt", "memory", "write", "too-big",
+                                  "limit", "timeout"};
+    return code >= 0 && code <= CONVERT_ERR_TIMEOUT ? names[code] : "unknown";
+}
+
+// errors worth another try: they depend on the machine's state at the
+// time (memory, file system) rather than on the image
+int convert_error_transient(int code) {
+    return code == CONVERT_ERR_OPEN || code == CONVERT_ERR_MEMORY || code == CONVERT_ERR_WRITE;
+}
+
+// decompression bomb guards: an image declaring more than these is refused
+// with CONVERT_ERR_LIMIT before anything is allocated for it. libpng is
+// held to the same width and height, and to at most convert_max_chunk
+// bytes per ancillary chunk and convert_max_chunks of them; it skips
+// chunks over those with a warning.
+png_uint_32 convert_max_width = 32768;
+png_uint_32 convert_max_height = 32768;
+unsigned long long convert_max_pixels = 1ULL << 28;
+png_alloc_size_t convert_max_chunk = 8000000;
+png_uint_32 convert_max_chunks = 1000;
+
+int convert_within_limits(png_uint_32 width, png_uint_32 height) {
+    return width <= convert_max_width && height <= convert_max_height &&
+           (unsigned long long)width * height <= convert_max_pixels;
+}
+
+// CPU seconds one conversion may take, 0 for no limit. A watchdog thread
+// reads the CPU clock of every thread that is converting and flags the
+// ones over the limit; the codecs check the flag between rows and give up
+// with CONVERT_ERR_TIMEOUT.
+#define CONVERT_WATCH_SLOTS 64     // to start with
+#define CONVERT_WATCH_INTERVAL_US 50000
+double convert_cpu_limit = 0;
+
+// runs fn(arg, i) for i in [0, count). driver.c points this at its pool so
+// the calls are spread over idle worker threads; by default they run in
+// order on the calling thread.
+static void convert_parallel_serial(int count, void (*fn)(void*, int), void* arg) {
+    for (int i = 0; i < count; i++)
+        fn(arg, i);
+}
+void (*convert_parallel)(int count, void (*fn)(void*, int), void* arg) = convert_parallel_serial;
+
+static pthread_key_t convert_context_key;
+static pthread_once_t convert_context_once = PTHREAD_ONCE_INIT;
+
 void abort_(const char * s, ...){
         va_list args;
         va_start(args, s);
@@ -28,72 +261,1673 @@ void abort_(const char * s, ...){
         abort();
 }
 
-int colorConvert(int argv, char* argc[]){
-    if (argv != 3){
-        abort_("usage: <executable> <input file> <output file>");
-        exit(EXIT_FAILURE);
+// writes one byte per 4K page so the faults are taken now, in one pass,
+// instead of scattered through decoding
+static void convert_touch_pages(unsigned char* p, size_t size) {
+    for (size_t i = 0; i < size; i += 4096)
+        ((volatile unsigned char*)p)[i] = 0;
+}
+
+// applies --numa-bind to a page aligned buffer
+static void convert_numa_place(unsigned char* p, size_t size) {
+    unsigned cpu, node;
+    unsigned long mask[CONVERT_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    if (!convert_numa_bind || syscall(SYS_getcpu, &cpu, &node, NULL) || node >= CONVERT_MAX_NODES)
+        return;
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, CONVERT_MAX_NODES, MPOL_MF_MOVE))
+        __atomic_add_fetch(&convert_numa_failures, 1, __ATOMIC_RELAXED);
+}
+
+// allocates an image buffer of at least *size bytes with the configured
+// page backing; *size is updated to what was actually reserved
+static unsigned char* convert_pages_alloc(size_t* size, int* mapped) {
+    unsigned char* p = NULL;
+    *mapped = 0;
+    if (convert_pages != CONVERT_PAGES_NORMAL) {
+        size_t len = (*size + CONVERT_HUGE_PAGE - 1) & ~(size_t)(CONVERT_HUGE_PAGE - 1);
+        void* m = MAP_FAILED;
+        if (convert_pages == CONVERT_PAGES_HUGETLB) {
+            m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (convert_prefault ? MAP_POPULATE : 0), -1, 0);
+            if (m == MAP_FAILED)
+                __atomic_add_fetch(&convert_hugetlb_fallbacks, 1, __ATOMIC_RELAXED);
+            else
+                convert_numa_place(m, len);
+        }
+        if (m == MAP_FAILED) {
+            // THP only backs 2 MB aligned ranges: map a page extra and trim
+            unsigned char* raw = mmap(NULL, len + CONVERT_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw != MAP_FAILED) {
+                unsigned char* aligned = (unsigned char*)(((uintptr_t)raw + CONVERT_HUGE_PAGE - 1) &
+                                                          ~(uintptr_t)(CONVERT_HUGE_PAGE - 1));
+                if (aligned > raw)
+                    munmap(raw, aligned - raw);
+                munmap(aligned + len, raw + CONVERT_HUGE_PAGE - aligned);
+                madvise(aligned, len, MADV_HUGEPAGE);
+                convert_numa_place(aligned, len);
+                if (convert_prefault)
+                    convert_touch_pages(aligned, len);
+                m = aligned;
+            }
+        }
+        if (m != MAP_FAILED) {
+            p = m;
+            *size = len;
+            *mapped = 1;
+        }
     }
-    char* fn_in = argc[1];
-    char* fn_out= argc[2];
-    unsigned char* img;
-    int avg;                  //agerage rgb pixel value
+    if (!p) {
+        // a policy only covers whole pages
+        void* m;
+        if (convert_numa_bind)
+            *size = (*size + 4095) & ~(size_t)4095;
+        if (posix_memalign(&m, convert_numa_bind ? 4096 : 64, *size))
+            return NULL;
+        p = m;
+        convert_numa_place(p, *size);
+        if (convert_prefault)
+            convert_touch_pages(p, *size);
+    }
+    if (convert_mlock && mlock(p, *size))
+        __atomic_add_fetch(&convert_mlock_failures, 1, __ATOMIC_RELAXED);
+    return p;
+}
 
+static void convert_buffer_release(ConvertBuffer* b) {
+    if (b->external)
+        b->pixels = NULL;
+    if (b->pixels && b->mapped)
+        munmap(b->pixels, b->size);
+    else if (b->pixels) {
+        if (convert_mlock)
+            munlock(b->pixels, b->size);
+        free(b->pixels);
+    }
+    free(b->rows);
+    memset(b, 0, sizeof(*b));
+}
+
+static void convert_context_free(void* p) {
+    ConvertContext* ctx = p;
+    if (ctx->inflater_ready)
+        inflateEnd(&ctx->inflater);
+    if (ctx->deflater_ready)
+        deflateEnd(&ctx->deflater);
+    if (ctx->strip_inflater_ready)
+        inflateEnd(&ctx->strip_inflater);
+    free(ctx->zbuf);
+    free(ctx->scratch);
+    free(ctx->zout);
+    free(ctx->idat_buf);
+    free(ctx->restart_offsets);
+    free(ctx->restart_adler);
+    convert_buffer_release(&ctx->image);
+    convert_buffer_release(&ctx->packed[0]);
+    convert_buffer_release(&ctx->packed[1]);
+    free(ctx->arena.base);
+    free(ctx);
+}
+
+static void convert_context_key_init(void) {
+    pthread_key_create(&convert_context_key, convert_context_free);
+}
+
+// returns the calling thread's context, creating it on first use
+ConvertContext* convert_context(void) {
+    pthread_once(&convert_context_once, convert_context_key_init);
+    ConvertContext* ctx = pthread_getspecific(convert_context_key);
+    if (ctx)
+        return ctx;
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        abort_("[convert_context] out of memory");
+    pthread_setspecific(convert_context_key, ctx);
+    return ctx;
+}
+
+// conversions being watched; grown to the number of threads converting at
+// once, so none runs without its limit
+static ConvertContext** convert_watched = NULL;
+static int convert_watch_size = 0;
+static pthread_mutex_t convert_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t convert_watch_wake = PTHREAD_COND_INITIALIZER;
+static pid_t convert_watchdog_pid = 0;  // process the watchdog thread is in
+static pthread_t convert_watchdog_thread;
+static int convert_watchdog_stop = 0;
+
+static double convert_cpu_seconds(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts))
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* convert_watchdog(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&convert_watch_lock);
+    while (!convert_watchdog_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += CONVERT_WATCH_INTERVAL_US * 1000L;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&convert_watch_wake, &convert_watch_lock, &until);
+        for (int i = 0; i < convert_watch_size; i++) {
+            ConvertContext* ctx = convert_watched[i];
+            if (ctx && convert_cpu_seconds(ctx->cpu_clock) - ctx->cpu_start > convert_cpu_limit)
+                __atomic_store_n(&ctx->cancelled, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&convert_watch_lock);
+    return NULL;
+}
+
+// starts timing the calling thread's conversion against convert_cpu_limit
+void convert_watch_begin(ConvertContext* ctx) {
+    ctx->cancelled = 0;
+    if (convert_cpu_limit <= 0)
+        return;
+    if (pthread_getcpuclockid(pthread_self(), &ctx->cpu_clock))
+        return;
+    ctx->cpu_start = convert_cpu_seconds(ctx->cpu_clock);
+    pthread_mutex_lock(&convert_watch_lock);
+    if (convert_watchdog_pid != getpid()) {
+        // first watch in this process; a forked worker inherits the table
+        // of its parent but none of the threads in it, nor the watchdog
+        if (convert_watch_size)
+            memset(convert_watched, 0, convert_watch_size * sizeof(*convert_watched));
+        convert_watchdog_stop = 0;
+        if (pthread_create(&convert_watchdog_thread, NULL, convert_watchdog, NULL) == 0)
+            convert_watchdog_pid = getpid();
+        else
+            fprintf(stderr, "[watchdog] cannot start; conversions run without the CPU limit\n");
+    }
+    int i = 0;
+    while (i < convert_watch_size && convert_watched[i])
+        i++;
+    if (i == convert_watch_size) {
+        int size = convert_watch_size ? 2 * convert_watch_size : CONVERT_WATCH_SLOTS;
+        ConvertContext** grown = realloc(convert_watched, size * sizeof(*grown));
+        if (grown) {
+            memset(grown + convert_watch_size, 0, (size - convert_watch_size) * sizeof(*grown));
+            convert_watched = grown;
+            convert_watch_size = size;
+        }
+    }
+    if (i < convert_watch_size)
+        convert_watched[i] = ctx;
+    else
+        fprintf(stderr, "[watchdog] out of memory; a conversion runs without the CPU limit\n");
+    pthread_mutex_unlock(&convert_watch_lock);
+}
+
+void convert_watch_end(ConvertContext* ctx) {
+    if (convert_cpu_limit <= 0)
+        return;
+    pthread_mutex_lock(&convert_watch_lock);
+    for (int i = 0; i < convert_watch_size; i++)
+        if (convert_watched[i] == ctx)
+            convert_watched[i] = NULL;
+    pthread_mutex_unlock(&convert_watch_lock);
+}
+
+// stops this process's watchdog, once no conversion is left to watch; the
+// next convert_watch_begin starts another
+void convert_watch_shutdown(void) {
+    pthread_mutex_lock(&convert_watch_lock);
+    if (convert_watchdog_pid != getpid()) {
+        pthread_mutex_unlock(&convert_watch_lock);
+        return;
+    }
+    convert_watchdog_stop = 1;
+    pthread_cond_signal(&convert_watch_wake);
+    pthread_mutex_unlock(&convert_watch_lock);
+    pthread_join(convert_watchdog_thread, NULL);
+    pthread_mutex_lock(&convert_watch_lock);
+    convert_watchdog_pid = 0;
+    pthread_mutex_unlock(&convert_watch_lock);
+}
+
+static int convert_cancelled(ConvertContext* ctx) {
+    return __atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED);
+}
+
+// records why the calling thread's conversion failed, reports it on
+// stderr as abort_ would, and returns code
+int convert_fail(int code, const char* s, ...) {
+    ConvertContext* ctx = convert_context();
+    char message[sizeof(ctx->error)];   // the arguments may be ctx->error
+    va_list args;
+    va_start(args, s);
+    vsnprintf(message, sizeof(message), s, args);
+    va_end(args);
+    memcpy(ctx->error, message, sizeof(message));
+    fprintf(stderr, "%s\n", ctx->error);
+    return code;
+}
+
+static int convert_timeout(const char* fn) {
+    return convert_fail(CONVERT_ERR_TIMEOUT, "[watchdog] %s: over the %gs CPU limit", fn, convert_cpu_limit);
+}
+
+// grow the scratch area to its high-water mark; only the first images of a
+// given size pay for the allocation
+static int convert_reserve_scratch(ConvertContext* ctx, size_t size) {
+    if (size <= ctx->scratch_size)
+        return 0;
+    unsigned char* p = realloc(ctx->scratch, size);
+    if (!p)
+        return -1;
+    ctx->scratch = p;
+    ctx->scratch_size = size;
+    return 0;
+}
+
+// staging buffer size for an image with raw_bytes of filtered rows: room
+// for the whole stream at a typical 4:1 ratio, so most images are written
+// as one IDAT chunk and inflated from a handful of reads
+static size_t convert_zbuf_for(size_t raw_bytes) {
+    if (convert_zbuf_size)
+        return convert_zbuf_size;
+    size_t size = CONVERT_ZBUF_MIN;
+    while (size < raw_bytes / 4 && size < CONVERT_ZBUF_MAX)
+        size *= 2;
+    return size;
+}
+
+// sizes the staging buffer for the next image. Like scratch it only grows,
+// but zbuf_size follows the image so chunk sizes do not depend on what the
+// thread converted before.
+static int convert_reserve_zbuf(ConvertContext* ctx, size_t size) {
+    if (size > ctx->zbuf_cap) {
+        unsigned char* p = realloc(ctx->zbuf, size);
+        if (!p)
+            return -1;
+        ctx->zbuf = p;
+        ctx->zbuf_cap = size;
+    }
+    ctx->zbuf_size = size;
+    return 0;
+}
+
+// lays out height rows of rowbytes in the buffer and returns their
+// pointers. Each row starts on a cache line; the block only grows, so a
+// worker stops allocating once it has seen its largest image. An external
+// buffer that is too small gives NULL.
+static png_bytep* convert_buffer_rows(ConvertBuffer* b, png_uint_32 height, size_t rowbytes) {
+    size_t stride = (rowbytes + 63) & ~(size_t)63;
+    size_t size = stride * height;
+    if (size > b->size && b->external)
+        return NULL;
+    if (size > b->size) {
+        png_bytep* rows = b->rows;
+        png_uint_32 rows_cap = b->rows_cap;
+        b->rows = NULL;
+        convert_buffer_release(b);
+        b->rows = rows;
+        b->rows_cap = rows_cap;
+        if ((b->pixels = convert_pages_alloc(&size, &b->mapped)) == NULL)
+            return NULL;
+        b->size = size;
+    }
+    if (height > b->rows_cap) {
+        png_bytep* rows = realloc(b->rows, height * sizeof(*rows));
+        if (!rows)
+            return NULL;
+        b->rows = rows;
+        b->rows_cap = height;
+    }
+    for (png_uint_32 y = 0; y < height; y++)
+        b->rows[y] = b->pixels + y * stride;
+    return b->rows;
+}
+
+#define CONVERT_ARENA_ALIGN 16
+#define CONVERT_ARENA_MIN (64 * 1024)
+
+static png_voidp convert_arena_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    ConvertArena* arena = png_get_mem_ptr(png_ptr);
+    size = (size + CONVERT_ARENA_ALIGN - 1) & ~(size_t)(CONVERT_ARENA_ALIGN - 1);
+    __atomic_add_fetch(&convert_png_allocs, 1, __ATOMIC_RELAXED);
+    if (arena->size - arena->used >= size) {
+        void* p = arena->base + arena->used;
+        arena->used += size;
+        return p;
+    }
+    __atomic_add_fetch(&convert_png_heap_allocs, 1, __ATOMIC_RELAXED);
+    void** p = malloc(CONVERT_ARENA_ALIGN + size);
+    if (!p)
+        return NULL;
+    *p = arena->spill;
+    arena->spill = p;
+    arena->spilled += size;
+    return (unsigned char*)p + CONVERT_ARENA_ALIGN;
+}
+
+// memory goes back in bulk in convert_arena_reset
+static void convert_arena_free(png_structp png_ptr, png_voidp p) {
+    (void)png_ptr;
+    (void)p;
+}
+
+static png_voidp convert_heap_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    (void)png_ptr;
+    __atomic_add_fetch(&convert_png_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&convert_png_heap_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void convert_heap_free(png_structp png_ptr, png_voidp p) {
+    (void)png_ptr;
+    free(p);
+}
+
+// called once the image's libpng structs are gone. Spilled allocations are
+// freed and the block grown to the whole image's high-water mark, so from
+// the next image of this size on nothing reaches malloc.
+static void convert_arena_reset(ConvertArena* arena) {
+    size_t need = arena->used + arena->spilled;
+    while (arena->spill) {
+        void* next = *(void**)arena->spill;
+        free(arena->spill);
+        arena->spill = next;
+    }
+    arena->spilled = 0;
+    arena->used = 0;
+    if (need > arena->size) {
+        size_t size = arena->size ? arena->size : CONVERT_ARENA_MIN;
+        while (size < need)
+            size *= 2;
+        free(arena->base);
+        arena->base = malloc(size);
+        arena->size = arena->base ? size : 0;
+    }
+}
+
+static int convert_reserve_restarts(ConvertContext* ctx, png_uint_32 count) {
+    if (count <= ctx->restart_cap)
+        return 0;
+    png_uint_32* offsets = realloc(ctx->restart_offsets, count * sizeof(*offsets));
+    if (offsets)
+        ctx->restart_offsets = offsets;
+    uLong* adler = realloc(ctx->restart_adler, count * sizeof(*adler));
+    if (adler)
+        ctx->restart_adler = adler;
+    if (!offsets || !adler)
+        return -1;
+    ctx->restart_cap = count;
+    return 0;
+}
+
+static png_uint_32 native_get_u32(const unsigned char* p) {
+    return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) |
+           ((png_uint_32)p[2] << 8) | (png_uint_32)p[3];
+}
+
+static void native_put_u32(unsigned char* p, png_uint_32 v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static int native_channels(int color_type) {
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:       return 1;
+    case PNG_COLOR_TYPE_GRAY_ALPHA: return 2;
+    case PNG_COLOR_TYPE_RGB:        return 3;
+    case PNG_COLOR_TYPE_RGB_ALPHA:  return 4;
+    }
+    return 0;
+}
+
+// zlib's own allocations for a thread's streams: a deflater at window 15
+// and memLevel 9 plus the two inflaters
+#define CONVERT_ZLIB_STATE (448 * 1024)
+
+// bytes the thread's context holds on to between images
+size_t convert_context_held(ConvertContext* ctx) {
+    size_t held = ctx->zbuf_cap + ctx->scratch_size + ctx->zout_size + ctx->idat_buf_size +
+                  ctx->arena.size + ctx->image.size + ctx->packed[0].size + ctx->packed[1].size;
+    if (ctx->deflater_ready || ctx->inflater_ready)
+        held += CONVERT_ZLIB_STATE;
+    return held;
+}
+
+// frees every pooled buffer bigger than keep, so a worker that met one
+// huge image does not hold its memory for the rest of the batch. A keep
+// below zlib's state ends the streams too (they are set up again on use).
+void convert_context_trim(ConvertContext* ctx, size_t keep) {
+    if (keep < CONVERT_ZLIB_STATE) {
+        if (ctx->inflater_ready)
+            inflateEnd(&ctx->inflater);
+        if (ctx->deflater_ready)
+            deflateEnd(&ctx->deflater);
+        if (ctx->strip_inflater_ready)
+            inflateEnd(&ctx->strip_inflater);
+        ctx->inflater_ready = ctx->deflater_ready = ctx->strip_inflater_ready = 0;
+    }
+    if (ctx->zbuf_cap > keep) {
+        free(ctx->zbuf);
+        ctx->zbuf = NULL;
+        ctx->zbuf_cap = ctx->zbuf_size = 0;
+    }
+    if (ctx->image.size > keep)
+        convert_buffer_release(&ctx->image);
+    for (int i = 0; i < 2; i++)
+        if (ctx->packed[i].size > keep)
+            convert_buffer_release(&ctx->packed[i]);
+    if (ctx->zout_size > keep) {
+        free(ctx->zout);
+        ctx->zout = NULL;
+        ctx->zout_size = 0;
+    }
+    if (ctx->idat_buf_size > keep) {
+        free(ctx->idat_buf);
+        ctx->idat_buf = NULL;
+        ctx->idat_buf_size = 0;
+    }
+    if (ctx->scratch_size > keep) {
+        free(ctx->scratch);
+        ctx->scratch = NULL;
+        ctx->scratch_size = 0;
+    }
+    if (ctx->arena.size > keep) {
+        free(ctx->arena.base);
+        ctx->arena.base = NULL;
+        ctx->arena.size = 0;
+    }
+}
+
+// reads the IHDR of the PNG at path without decoding anything, and the
+// file's size when file_size is not NULL. Returns -1 for anything that
+// does not start like a PNG.
+int convert_peek_header(const char* path, ConvertImage* image, size_t* file_size) {
+    unsigned char head[33];
+    struct stat st;
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    size_t n = fread(head, 1, sizeof(head), fp);
+    int ok = n == sizeof(head) && fstat(fileno(fp), &st) == 0;
+    fclose(fp);
+    if (!ok || png_sig_cmp(head, 0, 8) || memcmp(head + 12, "IHDR", 4))
+        return -1;
+    image->width = native_get_u32(head + 16);
+    image->height = native_get_u32(head + 20);
+    image->bit_depth = head[24];
+    image->color_type = head[25];
+    if (file_size)
+        *file_size = st.st_size;
+    return 0;
+}
+
+// rough peak memory of converting the PNG at path, worked out from its
+// IHDR: the decoded rows (at least 8 bit RGB), the compressed file, the
+// staging buffer and zlib's state, plus what the enabled options add (the
+// buffered stream behind a restart index, the optimizer's reduced copies).
+// Returns 0 when the header cannot be read.
+size_t convert_estimate_memory(const char* path) {
+    ConvertImage image;
+    size_t file_size;
+    if (convert_peek_header(path, &image, &file_size))
+        return 0;
+
+    size_t width = image.width, height = image.height;
+    int channels = image.color_type == PNG_COLOR_TYPE_PALETTE ? 1 : native_channels(image.color_type);
+    size_t pixel = channels * (image.bit_depth == 16 ? 2 : 1);
+    if (pixel < 3)
+        pixel = 3;
+    size_t raw = ((width * pixel + 63) & ~(size_t)63) * height;
+
+    size_t total = raw + file_size + convert_zbuf_for(raw) + CONVERT_ZLIB_STATE;
+    if (convert_restart_rows)
+        total += raw / 4;
+    if (convert_optimize)
+        total += 2 * width * height;
+    return total;
+}
+
+static int native_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/////////////////////////////////////////////////////
+// native reader
+/////////////////////////////////////////////////////
+
+// reads a chunk's length and type
+static int native_read_chunk_header(FILE* fp, png_uint_32* length, unsigned char type[4]) {
+    unsigned char buf[8];
+    if (fread(buf, 1, 8, fp) != 8)
+        return -1;
+    *length = native_get_u32(buf);
+    memcpy(type, buf + 4, 4);
+    return *length > PNG_UINT_31_MAX ? -1 : 0;
+}
+
+static int native_check_crc(FILE* fp, uLong crc) {
+    unsigned char buf[4];
+    if (fread(buf, 1, 4, fp) != 4)
+        return -1;
+    return native_get_u32(buf) == (png_uint_32)crc ? 0 : -1;
+}
+
+// loads a restart index chunk. Returns 1 without consuming anything when
+// the chunk is not one this reader understands, so it is skipped and the
+// image decodes sequentially; -1 when the chunk is damaged.
+static int native_read_restart_index(ConvertContext* ctx, FILE* fp, png_uint_32 length,
+                                     png_uint_32 height) {
+    unsigned char head[9];
+    if (length < 9 || fread(head, 1, 9, fp) != 9)
+        return -1;
+    png_uint_32 rows = native_get_u32(head + 1);
+    png_uint_32 count = native_get_u32(head + 5);
+    if (head[0] != RESTART_VERSION || rows == 0 || count != (height - 1) / rows + 1 ||
+        length != 9 + 4 * (size_t)count || convert_reserve_restarts(ctx, count)) {
+        return fseek(fp, -9, SEEK_CUR) ? -1 : 1;
+    }
+    uLong crc = cc_crc32(cc_crc32(0, (const unsigned char*)RESTART_CHUNK, 4), head, 9);
+    for (png_uint_32 i = 0; i < count; i++) {
+        unsigned char buf[4];
+        if (fread(buf, 1, 4, fp) != 4)
+            return -1;
+        crc = cc_crc32(crc, buf, 4);
+        ctx->restart_offsets[i] = native_get_u32(buf);
+        if (i ? ctx->restart_offsets[i] <= ctx->restart_offsets[i - 1] : ctx->restart_offsets[i] != 2)
+            count = 0;
+    }
+    if (native_check_crc(fp, crc))
+        return -1;
+    ctx->restart_rows = rows;
+    ctx->restart_count = count;
+    return 0;
+}
+
+// reads IHDR and skips ahead to the first IDAT. Returns 1 for a PNG the
+// native reader does not handle; the caller then rewinds to just past the
+// signature and hands the file to libpng.
+int native_read_header(ConvertContext* ctx, FILE* fp, png_uint_32* width, png_uint_32* height,
+                       png_uint_32* bit_depth, png_uint_32* color_type) {
+    png_uint_32 length;
+    unsigned char type[4];
+    unsigned char ihdr[13];
+
+    if (native_read_chunk_header(fp, &length, type) || length != 13 || memcmp(type, "IHDR", 4))
+        return -1;
+    if (fread(ihdr, 1, 13, fp) != 13)
+        return -1;
+    if (native_check_crc(fp, cc_crc32(cc_crc32(0, type, 4), ihdr, 13)))
+        return -1;
+
+    *width = native_get_u32(ihdr);
+    *height = native_get_u32(ihdr + 4);
+    *bit_depth = ihdr[8];
+    *color_type = ihdr[9];
+    if (*width == 0 || *height == 0 || *width > PNG_UINT_31_MAX || *height > PNG_UINT_31_MAX)
+        return -1;
+    if (ihdr[8] != 8 || ihdr[9] != PNG_COLOR_TYPE_RGB || ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0)
+        return 1;
+    if (convert_reserve_zbuf(ctx, convert_zbuf_for(((size_t)*width * 3 + 1) * *height)))
+        return -1;
+
+    // skip ancillary chunks (and a suggested PLTE) up to the image data,
+    // picking up a restart index on the way
+    ctx->restart_count = 0;
+    for (;;) {
+        if (native_read_chunk_header(fp, &length, type))
+            return -1;
+        if (!memcmp(type, "IDAT", 4))
+            break;
+        if (!memcmp(type, "IEND", 4))
+            return -1;
+        if (!memcmp(type, RESTART_CHUNK, 4)) {
+            int rc = native_read_restart_index(ctx, fp, length, *height);
+            if (rc < 0)
+                return -1;
+            if (rc == 0)
+                continue;
+        }
+        if (fseek(fp, (long)length + 4, SEEK_CUR))
+            return -1;
+    }
+    ctx->idat_left = length;
+    ctx->idat_crc = cc_crc32(0, type, 4);
+    return 0;
+}
+
+// undo one row's filter; src is the filtered row, prev the previous
+// reconstructed row (all zeros for the first row)
+static int native_unfilter_row(int filter, const png_byte* src, const png_byte* prev,
+                               png_byte* dst, size_t rowbytes, int bpp) {
+    size_t i;
+    switch (filter) {
+    case PNG_FILTER_VALUE_NONE:
+        memcpy(dst, src, rowbytes);
+        break;
+    case PNG_FILTER_VALUE_SUB:
+        for (i = 0; i < (size_t)bpp; i++)
+            dst[i] = src[i];
+        for (; i < rowbytes; i++)
+            dst[i] = src[i] + dst[i - bpp];
+        break;
+    case PNG_FILTER_VALUE_UP:
+        for (i = 0; i < rowbytes; i++)
+            dst[i] = src[i] + prev[i];
+        break;
+    case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < (size_t)bpp; i++)
+            dst[i] = src[i] + (prev[i] >> 1);
+        for (; i < rowbytes; i++)
+            dst[i] = src[i] + ((dst[i - bpp] + prev[i]) >> 1);
+        break;
+    case PNG_FILTER_VALUE_PAETH:
+        for (i = 0; i < (size_t)bpp; i++)
+            dst[i] = src[i] + prev[i];
+        for (; i < rowbytes; i++)
+            dst[i] = src[i] + native_paeth(dst[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+// zlib streams are inflated and deflated raw, with the 2 byte header and
+// the adler32 trailer handled here so the checksum runs through cc_adler32
+static int native_zlib_header_ok(const unsigned char* head) {
+    return (head[0] & 0x0f) == Z_DEFLATED && (head[0] >> 4) <= 7 && !(head[1] & 0x20) &&
+           ((head[0] << 8) | head[1]) % 31 == 0;
+}
+
+// one image being inflated strip by strip from its restart index
+typedef struct StripJob {
+    const unsigned char* data;  // the whole zlib stream
+    size_t length;
+    const png_uint_32* offsets;
+    uLong* adler;
+    png_uint_32 rows_per_strip;
+    png_bytep* row_pointers;
+    png_uint_32 width, height;
+    int failed;
+} StripJob;
+
+// inflates and unfilters strip k on whichever thread runs it
+static void native_inflate_strip(void* arg, int k) {
+    StripJob* job = arg;
+    ConvertContext* ctx = convert_context();
+    z_stream* zs = &ctx->strip_inflater;
+    const int bpp = 3;
+    size_t rowbytes = (size_t)job->width * bpp;
+    png_uint_32 y0 = k * job->rows_per_strip;
+    png_uint_32 y1 = y0 + job->rows_per_strip < job->height ? y0 + job->rows_per_strip : job->height;
+    size_t start = job->offsets[k];
+    size_t end = y1 < job->height ? job->offsets[k + 1] : job->length - 4;
+
+    if (start >= end || end > job->length || convert_reserve_scratch(ctx, rowbytes + 1)) {
+        job->failed = 1;
+        return;
+    }
+    if (!ctx->strip_inflater_ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit2(zs, -15) != Z_OK) {
+            job->failed = 1;
+            return;
+        }
+        ctx->strip_inflater_ready = 1;
+    } else if (inflateReset(zs) != Z_OK) {
+        job->failed = 1;
+        return;
+    }
+    zs->next_in = (unsigned char*)job->data + start;
+    zs->avail_in = end - start;
+
+    unsigned char* raw = ctx->scratch;
+    uLong adler = adler32(0, NULL, 0);
+    for (png_uint_32 y = y0; y < y1 && !job->failed; y++) {
+        zs->next_out = raw;
+        zs->avail_out = rowbytes + 1;
+        int ret = inflate(zs, Z_SYNC_FLUSH);
+        // the first row of a strip must not look at the strip before it
+        if ((ret != Z_OK && ret != Z_STREAM_END) || zs->avail_out != 0 ||
+            (y == y0 && raw[0] > PNG_FILTER_VALUE_SUB) ||
+            native_unfilter_row(raw[0], raw + 1, y == y0 ? raw + 1 : job->row_pointers[y - 1],
+                                job->row_pointers[y], rowbytes, bpp))
+            job->failed = 1;
+        adler = cc_adler32(adler, raw, rowbytes + 1);
+    }
+    job->adler[k] = adler;
+}
+
+// decodes an image that carries a restart index: all IDAT data is read in,
+// then the strips are inflated on the pool in parallel and their adler32s
+// combined and checked against the stream trailer. Returns 1 when the index
+// turns out not to match the data, so the caller can use libpng instead.
+static int native_read_rows_parallel(ConvertContext* ctx, FILE* fp, png_bytep* row_pointers,
+                                     png_uint_32 width, png_uint_32 height) {
+    size_t used = 0;
+    png_uint_32 length;
+    unsigned char type[4];
+
+    for (;;) {
+        if (used + ctx->idat_left > ctx->idat_buf_size) {
+            size_t size = ctx->idat_buf_size ? ctx->idat_buf_size : 65536;
+            while (size < used + ctx->idat_left)
+                size *= 2;
+            unsigned char* p = realloc(ctx->idat_buf, size);
+            if (!p)
+                return -1;
+            ctx->idat_buf = p;
+            ctx->idat_buf_size = size;
+        }
+        if (fread(ctx->idat_buf + used, 1, ctx->idat_left, fp) != ctx->idat_left)
+            return -1;
+        ctx->idat_crc = cc_crc32(ctx->idat_crc, ctx->idat_buf + used, ctx->idat_left);
+        used += ctx->idat_left;
+        if (native_check_crc(fp, ctx->idat_crc))
+            return -1;
+        if (native_read_chunk_header(fp, &length, type))
+            return -1;
+        if (memcmp(type, "IDAT", 4))
+            break;
+        ctx->idat_left = length;
+        ctx->idat_crc = cc_crc32(0, type, 4);
+    }
+    if (used < 6 || !native_zlib_header_ok(ctx->idat_buf))
+        return -1;
+
+    StripJob job = {
+        .data = ctx->idat_buf, .length = used,
+        .offsets = ctx->restart_offsets, .adler = ctx->restart_adler,
+        .rows_per_strip = ctx->restart_rows, .row_pointers = row_pointers,
+        .width = width, .height = height,
+    };
+    convert_parallel(ctx->restart_count, native_inflate_strip, &job);
+    if (job.failed)
+        return 1;
+
+    size_t strip_bytes = ((size_t)width * 3 + 1) * ctx->restart_rows;
+    uLong adler = job.adler[0];
+    for (png_uint_32 k = 1; k < ctx->restart_count; k++) {
+        png_uint_32 rows = k + 1 < ctx->restart_count ? ctx->restart_rows
+                                                      : height - k * ctx->restart_rows;
+        adler = adler32_combine(adler, job.adler[k], rows == ctx->restart_rows ? strip_bytes
+                                                     : ((size_t)width * 3 + 1) * rows);
+    }
+    return native_get_u32(ctx->idat_buf + used - 4) == (png_uint_32)adler ? 0 : 1;
+}
+
+// refills the inflater's input from the current IDAT chunk, moving on to
+// the next one once it is used up
+static int native_fill_input(ConvertContext* ctx, FILE* fp) {
+    z_stream* zs = &ctx->inflater;
+    png_uint_32 length;
+    unsigned char type[4];
+    while (ctx->idat_left == 0) {
+        if (native_check_crc(fp, ctx->idat_crc))
+            return -1;
+        if (native_read_chunk_header(fp, &length, type) || memcmp(type, "IDAT", 4))
+            return -1;
+        ctx->idat_left = length;
+        ctx->idat_crc = cc_crc32(0, type, 4);
+    }
+    size_t n = ctx->idat_left < ctx->zbuf_size ? ctx->idat_left : ctx->zbuf_size;
+    if (fread(ctx->zbuf, 1, n, fp) != n)
+        return -1;
+    ctx->idat_crc = cc_crc32(ctx->idat_crc, ctx->zbuf, n);
+    ctx->idat_left -= n;
+    zs->next_in = ctx->zbuf;
+    zs->avail_in = n;
+    return 0;
+}
+
+// takes n bytes of the zlib stream that zlib itself does not see (header
+// and trailer)
+static int native_take_input(ConvertContext* ctx, FILE* fp, unsigned char* dst, size_t n) {
+    z_stream* zs = &ctx->inflater;
+    while (n) {
+        if (zs->avail_in == 0 && native_fill_input(ctx, fp))
+            return -1;
+        *dst++ = *zs->next_in++;
+        zs->avail_in--;
+        n--;
+    }
+    return 0;
+}
+
+// inflates the IDAT stream straight into row_pointers. Returns 1 when the
+// image should be read again with libpng.
+int native_read_rows(ConvertContext* ctx, FILE* fp, png_bytep* row_pointers,
+                     png_uint_32 width, png_uint_32 height) {
+    // strips only pay off when there are other threads to run them
+    if (ctx->restart_count > 1 && convert_parallel != convert_parallel_serial)
+        return native_read_rows_parallel(ctx, fp, row_pointers, width, height);
+
+    const int bpp = 3;
+    size_t rowbytes = (size_t)width * bpp;
+    size_t fill = 0;
+    png_uint_32 y = 0;
+    z_stream* zs = &ctx->inflater;
+    unsigned char head[4];
+    int ret = Z_OK;
+
+    // scratch holds the filtered row (filter byte first) and a zero row
+    if (convert_reserve_scratch(ctx, 2 * (rowbytes + 1)))
+        return -1;
+    unsigned char* raw = ctx->scratch;
+    unsigned char* zero = ctx->scratch + rowbytes + 1;
+    memset(zero, 0, rowbytes);
+
+    if (!ctx->inflater_ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit2(zs, -15) != Z_OK)
+            return -1;
+        ctx->inflater_ready = 1;
+    } else if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->avail_in = 0;
+    if (native_take_input(ctx, fp, head, 2) || !native_zlib_header_ok(head))
+        return -1;
+    uLong adler = adler32(0, NULL, 0);
+
+    while (y < height) {
+        if (convert_cancelled(ctx))
+            return -1;
+        if (zs->avail_in == 0 && native_fill_input(ctx, fp))
+            return -1;
+        zs->next_out = raw + fill;
+        zs->avail_out = rowbytes + 1 - fill;
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return -1;
+        fill = rowbytes + 1 - zs->avail_out;
+        if (fill == rowbytes + 1) {
+            const png_byte* prev = y ? row_pointers[y - 1] : zero;
+            if (native_unfilter_row(raw[0], raw + 1, prev, row_pointers[y], rowbytes, bpp))
+                return -1;
+            adler = cc_adler32(adler, raw, rowbytes + 1);
+            y++;
+            fill = 0;
+        } else if (ret == Z_STREAM_END) {
+            return -1;  // stream ended before the last row
+        }
+    }
+
+    // run the stream to its end (there must be no more data) and check the
+    // trailer
+    while (ret != Z_STREAM_END) {
+        if (zs->avail_in == 0 && native_fill_input(ctx, fp))
+            return -1;
+        zs->next_out = head;
+        zs->avail_out = 1;
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (zs->avail_out == 0 || (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR))
+            return -1;
+    }
+    if (native_take_input(ctx, fp, head, 4))
+        return -1;
+    return native_get_u32(head) == (png_uint_32)adler ? 0 : -1;
+}
+
+/////////////////////////////////////////////////////
+// native writer
+/////////////////////////////////////////////////////
+
+static int native_write_chunk(FILE* fp, const char* type, const unsigned char* data, png_uint_32 length) {
+    unsigned char buf[8];
+    native_put_u32(buf, length);
+    memcpy(buf + 4, type, 4);
+    uLong crc = cc_crc32(0, buf + 4, 4);
+    if (length)
+        crc = cc_crc32(crc, data, length);
+    if (fwrite(buf, 1, 8, fp) != 8)
+        return -1;
+    if (length && fwrite(data, 1, length, fp) != length)
+        return -1;
+    native_put_u32(buf, (png_uint_32)crc);
+    return fwrite(buf, 1, 4, fp) == 4 ? 0 : -1;
+}
+
+// applies one filter type to a row; dst[0] receives the filter byte
+static void native_apply_filter(int f, const png_byte* row, const png_byte* prev,
+                                unsigned char* dst, size_t rowbytes, int bpp) {
+    size_t i;
+    *dst++ = (unsigned char)f;
+    switch (f) {
+    case PNG_FILTER_VALUE_NONE:
+        memcpy(dst, row, rowbytes);
+        break;
+    case PNG_FILTER_VALUE_SUB:
+        for (i = 0; i < rowbytes; i++)
+            dst[i] = row[i] - (i >= (size_t)bpp ? row[i - bpp] : 0);
+        break;
+    case PNG_FILTER_VALUE_UP:
+        for (i = 0; i < rowbytes; i++)
+            dst[i] = row[i] - prev[i];
+        break;
+    case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < rowbytes; i++)
+            dst[i] = row[i] - (((i >= (size_t)bpp ? row[i - bpp] : 0) + prev[i]) >> 1);
+        break;
+    case PNG_FILTER_VALUE_PAETH:
+        for (i = 0; i < (size_t)bpp && i < rowbytes; i++)
+            dst[i] = row[i] - prev[i];
+        for (; i < rowbytes; i++)
+            dst[i] = row[i] - native_paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    }
+}
+
+// filters a row with every filter type into out[0..4] (each rowbytes + 1
+// long, filter byte first) and returns the one up to max_filter with the
+// smallest sum of absolute residuals, the same heuristic libpng uses
+static int native_filter_row(const png_byte* row, const png_byte* prev, size_t rowbytes,
+                             int bpp, unsigned char* out, int max_filter) {
+    size_t stride = rowbytes + 1;
+    unsigned char* none = out + 1;
+    unsigned char* sub = out + stride + 1;
+    unsigned char* up = out + 2 * stride + 1;
+    unsigned char* avg = out + 3 * stride + 1;
+    unsigned char* paeth = out + 4 * stride + 1;
+    unsigned long sum[5] = {0, 0, 0, 0, 0};
+    size_t i;
+
+    for (int f = 0; f < 5; f++)
+        out[f * stride] = (unsigned char)f;
+    for (i = 0; i < (size_t)bpp && i < rowbytes; i++) {
+        none[i] = sub[i] = row[i];
+        up[i] = paeth[i] = row[i] - prev[i];
+        avg[i] = row[i] - (prev[i] >> 1);
+    }
+    for (; i < rowbytes; i++) {
+        int a = row[i - bpp], b = prev[i], c = prev[i - bpp];
+        none[i] = row[i];
+        sub[i] = row[i] - a;
+        up[i] = row[i] - b;
+        avg[i] = row[i] - ((a + b) >> 1);
+        paeth[i] = row[i] - native_paeth(a, b, c);
+    }
+    // residuals are compared as signed bytes
+    for (int f = 0; f < 5; f++) {
+        const signed char* r = (const signed char*)(out + f * stride + 1);
+        unsigned long s = 0;
+        for (i = 0; i < rowbytes; i++)
+            s += abs(r[i]);
+        sum[f] = s;
+    }
+    int best = 0;
+    for (int f = 1; f <= max_filter; f++)
+        if (sum[f] < sum[best])
+            best = f;
+    return best;
+}
+
+// makes room for more compressed output: while buffering the buffer
+// grows, otherwise what has been produced goes out as an IDAT chunk (or is
+// only counted when there is no file, for the optimizer's trials)
+static int native_drain(ConvertContext* ctx, FILE* fp) {
+    z_stream* zs = &ctx->deflater;
+    if (ctx->buffering) {
+        size_t used = zs->next_out - ctx->zout;
+        unsigned char* p = realloc(ctx->zout, 2 * ctx->zout_size);
+        if (!p)
+            return -1;
+        ctx->zout = p;
+        ctx->zout_size *= 2;
+        zs->next_out = p + used;
+        zs->avail_out = ctx->zout_size - used;
+        return 0;
+    }
+    size_t n = ctx->zbuf_size - zs->avail_out;
+    if (n && fp && native_write_chunk(fp, "IDAT", ctx->zbuf, n))
+        return -1;
+    ctx->encoded_size += n;
+    zs->next_out = ctx->zbuf;
+    zs->avail_out = ctx->zbuf_size;
+    return 0;
+}
+
+// deflates len bytes; flush is Z_NO_FLUSH for row data, Z_FULL_FLUSH at a
+// restart point and Z_FINISH at the end, where the adler32 trailer is
+// appended
+static int native_deflate(ConvertContext* ctx, FILE* fp, const unsigned char* data, size_t len, int flush) {
+    z_stream* zs = &ctx->deflater;
+    zs->next_in = (unsigned char*)data;
+    zs->avail_in = len;
+    if (len)
+        ctx->adler = cc_adler32(ctx->adler, data, len);
+    for (;;) {
+        int ret = deflate(zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (ret == Z_STREAM_END) {
+            if (zs->avail_out < 4 && native_drain(ctx, fp))
+                return -1;
+            native_put_u32(zs->next_out, (png_uint_32)ctx->adler);
+            zs->next_out += 4;
+            zs->avail_out -= 4;
+            return ctx->buffering ? 0 : native_drain(ctx, fp);
+        }
+        // a call that filled the buffer may have more output pending
+        int full = zs->avail_out == 0;
+        if (full && native_drain(ctx, fp))
+            return -1;
+        if (flush != Z_FINISH && zs->avail_in == 0 && !full)
+            return 0;
+    }
+}
+
+// starts the zlib stream: a raw deflate stream gets the header zlib would
+// have written for these parameters
+static void native_deflate_header(ConvertContext* ctx, const EncodeOptions* opts) {
+    z_stream* zs = &ctx->deflater;
+    int level = opts->level == Z_DEFAULT_COMPRESSION ? 6 : opts->level;
+    int flags = opts->strategy >= Z_HUFFMAN_ONLY || level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned header = (((opts->window_bits - 8) << 4 | Z_DEFLATED) << 8) | (flags << 6);
+    header += 31 - header % 31;
+    zs->next_out[0] = (unsigned char)(header >> 8);
+    zs->next_out[1] = (unsigned char)header;
+    zs->next_out += 2;
+    zs->avail_out -= 2;
+    ctx->adler = adler32(0, NULL, 0);
+}
+
+// writes the restart index and then the buffered stream as IDAT chunks
+static int native_write_buffered(ConvertContext* ctx, FILE* fp, png_uint_32 rows, png_uint_32 count) {
+    size_t length = ctx->deflater.next_out - ctx->zout;
+    size_t index_size = 9 + 4 * (size_t)count;
+    // the index is assembled in the scratch area, which is done with by now
+    if (convert_reserve_scratch(ctx, index_size))
+        return -1;
+    unsigned char* index = ctx->scratch;
+    index[0] = RESTART_VERSION;
+    native_put_u32(index + 1, rows);
+    native_put_u32(index + 5, count);
+    for (png_uint_32 i = 0; i < count; i++)
+        native_put_u32(index + 9 + 4 * i, ctx->restart_offsets[i]);
+    if (native_write_chunk(fp, RESTART_CHUNK, index, index_size))
+        return -1;
+    for (size_t pos = 0; pos < length; pos += ctx->zbuf_size) {
+        size_t n = length - pos < ctx->zbuf_size ? length - pos : ctx->zbuf_size;
+        if (native_write_chunk(fp, "IDAT", ctx->zout + pos, n))
+            return -1;
+    }
+    ctx->encoded_size = length;
+    return 0;
+}
+
+// readies the thread's deflate stream for a new image with the given
+// parameters. Level and strategy changes are applied to the finished stream
+// before the reset; only a different window or memLevel needs a new stream.
+static int native_deflate_begin(ConvertContext* ctx, const EncodeOptions* opts) {
+    z_stream* zs = &ctx->deflater;
+    if (ctx->deflater_ready && (opts->window_bits != ctx->deflate_window ||
+                                opts->mem_level != ctx->deflate_mem)) {
+        deflateEnd(zs);
+        ctx->deflater_ready = 0;
+    }
+    if (!ctx->deflater_ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (deflateInit2(zs, opts->level, Z_DEFLATED, -opts->window_bits, opts->mem_level,
+                         opts->strategy) != Z_OK)
+            return -1;
+        ctx->deflater_ready = 1;
+    } else {
+        // reset first: the stream is still finished from the last image,
+        // and deflateParams would try to flush it
+        if (deflateReset(zs) != Z_OK)
+            return -1;
+        if (opts->level != ctx->deflate_level || opts->strategy != ctx->deflate_strategy) {
+            zs->next_out = ctx->zbuf;
+            zs->avail_out = ctx->zbuf_size;
+            if (deflateParams(zs, opts->level, opts->strategy) != Z_OK)
+                return -1;
+        }
+    }
+    ctx->deflate_level = opts->level;
+    ctx->deflate_strategy = opts->strategy;
+    ctx->deflate_window = opts->window_bits;
+    ctx->deflate_mem = opts->mem_level;
+    zs->next_out = ctx->zbuf;
+    zs->avail_out = ctx->zbuf_size;
+    ctx->encoded_size = 0;
+    return 0;
+}
+
+// readies ctx to encode height rows of rowbytes: scratch for five
+// candidate filtered rows plus a zero row above the first image row, the
+// staging buffer and the deflate stream
+static int native_encode_setup(ConvertContext* ctx, size_t rowbytes, png_uint_32 height,
+                               const EncodeOptions* opts) {
+    if (convert_reserve_scratch(ctx, 5 * (rowbytes + 1) + rowbytes))
+        return -1;
+    memset(ctx->scratch + 5 * (rowbytes + 1), 0, rowbytes);
+    if (convert_reserve_zbuf(ctx, convert_zbuf_for((rowbytes + 1) * height)))
+        return -1;
+    return native_deflate_begin(ctx, opts);
+}
+
+// signature, IHDR and, for palette images, PLTE
+static int native_write_ihdr(FILE* fp, png_uint_32 width, png_uint_32 height, const EncodeOptions* opts) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    unsigned char ihdr[13];
+    native_put_u32(ihdr, width);
+    native_put_u32(ihdr + 4, height);
+    ihdr[8] = (unsigned char)opts->bit_depth;
+    ihdr[9] = (unsigned char)opts->color_type;
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    if (fwrite(signature, 1, 8, fp) != 8 || native_write_chunk(fp, "IHDR", ihdr, 13))
+        return -1;
+    if (opts->color_type == PNG_COLOR_TYPE_PALETTE &&
+        native_write_chunk(fp, "PLTE", opts->palette, 3 * opts->palette_size))
+        return -1;
+    return 0;
+}
+
+// filters a row against the one above it (NULL for the first row) and
+// deflates it. The first row of a restart strip (strip_start) may only
+// use filters that do not look at the row above.
+static int native_encode_row(ConvertContext* ctx, FILE* fp, const png_byte* row, const png_byte* prev,
+                             size_t rowbytes, int bpp, int filter, int strip_start) {
+    int f = filter;
+    if (!prev)
+        prev = ctx->scratch + 5 * (rowbytes + 1);
+    if (f == NATIVE_FILTER_ADAPTIVE)
+        f = native_filter_row(row, prev, rowbytes, bpp, ctx->scratch,
+                              strip_start ? PNG_FILTER_VALUE_SUB : PNG_FILTER_VALUE_PAETH);
+    else {
+        if (strip_start && f > PNG_FILTER_VALUE_SUB)
+            f = PNG_FILTER_VALUE_SUB;
+        native_apply_filter(f, row, prev, ctx->scratch + f * (rowbytes + 1), rowbytes, bpp);
+    }
+    return native_deflate(ctx, fp, ctx->scratch + f * (rowbytes + 1), rowbytes + 1, Z_NO_FLUSH);
+}
+
+// writes a non-interlaced PNG using the thread's deflate stream. Rows must
+// already be packed for opts' bit depth and color type. With fp NULL nothing
+// is written and ctx->encoded_size ends up holding the IDAT payload size.
+int native_write_png(ConvertContext* ctx, FILE* fp, png_bytep* row_pointers, png_uint_32 width,
+                     png_uint_32 height, const EncodeOptions* opts) {
+    int channels = opts->color_type == PNG_COLOR_TYPE_PALETTE ? 1 : native_channels(opts->color_type);
+    int bits = channels * opts->bit_depth;
+    int bpp = bits >= 8 ? bits / 8 : 1;
+    size_t rowbytes = ((size_t)width * bits + 7) / 8;
+
+    if (channels == 0)
+        return -1;
+    if (native_encode_setup(ctx, rowbytes, height, opts))
+        return -1;
+
+    // a restart index has to precede the image data, so the stream is
+    // collected in memory first and written out once its offsets are known
+    png_uint_32 restart_rows = fp ? opts->restart_rows : 0;
+    png_uint_32 restart_count = restart_rows ? (height - 1) / restart_rows + 1 : 0;
+    if (restart_rows) {
+        if (convert_reserve_restarts(ctx, restart_count))
+            return -1;
+        if (!ctx->zout) {
+            if ((ctx->zout = malloc(ctx->zbuf_size)) == NULL)
+                return -1;
+            ctx->zout_size = ctx->zbuf_size;
+        }
+        ctx->buffering = 1;
+        ctx->deflater.next_out = ctx->zout;
+        ctx->deflater.avail_out = ctx->zout_size;
+    }
+    native_deflate_header(ctx, opts);
+
+    if (fp && native_write_ihdr(fp, width, height, opts))
+        return -1;
+
+    int rc = 0;
+    for (png_uint_32 y = 0; y < height && rc == 0; y++) {
+        if (convert_cancelled(ctx)) {
+            rc = -1;
+            break;
+        }
+        int strip_start = restart_rows && y % restart_rows == 0;
+        if (strip_start) {
+            if (y && native_deflate(ctx, fp, NULL, 0, Z_FULL_FLUSH)) {
+                rc = -1;
+                break;
+            }
+            ctx->restart_offsets[y / restart_rows] = ctx->deflater.next_out - ctx->zout;
+        }
+        if (native_encode_row(ctx, fp, row_pointers[y], y ? row_pointers[y - 1] : NULL, rowbytes, bpp,
+                              opts->filter, strip_start))
+            rc = -1;
+    }
+    if (rc == 0 && native_deflate(ctx, fp, NULL, 0, Z_FINISH))
+        rc = -1;
+    if (restart_rows) {
+        ctx->buffering = 0;
+        if (rc == 0)
+            rc = native_write_buffered(ctx, fp, restart_rows, restart_count);
+    }
+    if (rc)
+        return rc;
+    return fp ? native_write_chunk(fp, "IEND", NULL, 0) : 0;
+}
+
+/////////////////////////////////////////////////////
+// lossless optimizer: reduce bit depth and color type where the pixels
+// allow it, then search filter/strategy/memLevel combinations for the
+// smallest IDAT, the way optipng does
+/////////////////////////////////////////////////////
+
+// totals over every image the optimizer has written
+long long optimize_bytes_before = 0;
+long long optimize_bytes_after = 0;
+
+#define OPTIMIZE_MAX_FORMATS 2
+
+static const int optimize_filters[] = {
+    PNG_FILTER_VALUE_NONE, PNG_FILTER_VALUE_SUB, PNG_FILTER_VALUE_UP,
+    PNG_FILTER_VALUE_AVG, PNG_FILTER_VALUE_PAETH, NATIVE_FILTER_ADAPTIVE
+};
+static const int optimize_strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE};
+static const int optimize_mem_levels[] = {8, 9};
+
+#define OPTIMIZE_FILTERS (int)(sizeof(optimize_filters) / sizeof(optimize_filters[0]))
+#define OPTIMIZE_STRATEGIES (int)(sizeof(optimize_strategies) / sizeof(optimize_strategies[0]))
+#define OPTIMIZE_MEM_LEVELS (int)(sizeof(optimize_mem_levels) / sizeof(optimize_mem_levels[0]))
+#define OPTIMIZE_TRIALS_PER_FORMAT (OPTIMIZE_FILTERS * OPTIMIZE_STRATEGIES * OPTIMIZE_MEM_LEVELS)
+
+// one candidate pixel format: packed rows plus how to describe them
+typedef struct OptimizeFormat {
+    EncodeOptions opts;
+    png_bytep* rows;
+    unsigned char palette[256 * 3];
+} OptimizeFormat;
+
+typedef struct OptimizeJob {
+    OptimizeFormat formats[OPTIMIZE_MAX_FORMATS];
+    int format_count;
+    png_uint_32 width, height;
+    size_t sizes[OPTIMIZE_MAX_FORMATS * OPTIMIZE_TRIALS_PER_FORMAT];
+} OptimizeJob;
+
+static void optimize_trial_options(const OptimizeJob* job, int trial, EncodeOptions* opts) {
+    int format = trial / OPTIMIZE_TRIALS_PER_FORMAT;
+    int rest = trial % OPTIMIZE_TRIALS_PER_FORMAT;
+    *opts = job->formats[format].opts;
+    opts->filter = optimize_filters[rest % OPTIMIZE_FILTERS];
+    opts->strategy = optimize_strategies[rest / OPTIMIZE_FILTERS % OPTIMIZE_STRATEGIES];
+    opts->mem_level = optimize_mem_levels[rest / (OPTIMIZE_FILTERS * OPTIMIZE_STRATEGIES)];
+    opts->level = Z_BEST_COMPRESSION;
+}
+
+// one trial, run on whichever thread picks it up, using that thread's context
+static void optimize_trial(void* arg, int trial) {
+    OptimizeJob* job = arg;
+    const OptimizeFormat* format = &job->formats[trial / OPTIMIZE_TRIALS_PER_FORMAT];
+    ConvertContext* ctx = convert_context();
+    EncodeOptions opts;
+    optimize_trial_options(job, trial, &opts);
+    if (native_write_png(ctx, NULL, format->rows, job->width, job->height, &opts))
+        job->sizes[trial] = (size_t)-1;
+    else
+        job->sizes[trial] = ctx->encoded_size + 3 * opts.palette_size;
+}
+
+// sets up zeroed rows for a reduced format in the thread's packed buffer;
+// samples are then OR'ed in with optimize_put_sample
+static int optimize_pack(OptimizeFormat* format, ConvertBuffer* buffer, png_uint_32 width,
+                         png_uint_32 height, int channels, int bit_depth) {
+    size_t rowbytes = ((size_t)width * channels * bit_depth + 7) / 8;
+    if ((format->rows = convert_buffer_rows(buffer, height, rowbytes)) == NULL)
+        return -1;
+    for (png_uint_32 y = 0; y < height; y++)
+        memset(format->rows[y], 0, rowbytes);
+    return 0;
+}
+
+static void optimize_put_sample(png_bytep row, png_uint_32 x, int bit_depth, int v) {
+    if (bit_depth == 8) {
+        row[x] = (png_byte)v;
+        return;
+    }
+    int per_byte = 8 / bit_depth;
+    int shift = 8 - bit_depth * (1 + x % per_byte);
+    row[x / per_byte] |= (png_byte)(v << shift);
+}
+
+static int optimize_depth_for(int levels) {
+    return levels <= 2 ? 1 : levels <= 4 ? 2 : levels <= 16 ? 4 : 8;
+}
+
+// palette index of an rgb value, added if missing; -1 once the image has
+// more than 256 colors. The table is a small open-addressed hash.
+static int optimize_palette_index(int* table, unsigned char* palette, int* count, png_uint_32 rgb) {
+    unsigned h = (rgb * 2654435761u) >> 23;   // 9 bits: 512 slots
+    for (;;) {
+        int e = table[h];
+        if (e < 0) {
+            if (*count == 256)
+                return -1;
+            palette[3 * *count] = (unsigned char)(rgb >> 16);
+            palette[3 * *count + 1] = (unsigned char)(rgb >> 8);
+            palette[3 * *count + 2] = (unsigned char)rgb;
+            table[h] = *count;
+            return (*count)++;
+        }
+        const unsigned char* p = &palette[3 * e];
+        if ((((png_uint_32)p[0] << 16) | (p[1] << 8) | p[2]) == rgb)
+            return e;
+        h = (h + 1) & 511;
+    }
+}
+
+// works out which reduced formats can hold the 8 bit RGB image losslessly:
+// grayscale at the smallest bit depth that keeps every level, and a palette
+// when there are at most 256 colors and that is smaller than the alternative
+static int optimize_formats(OptimizeJob* job, png_bytep* rgb_rows) {
+    ConvertContext* ctx = convert_context();
+    png_uint_32 width = job->width, height = job->height;
+    int gray = 1, gray_depth = 1;
+    int table[512];
+    unsigned char palette[256 * 3];
+    int colors = 0;
+
+    memset(table, -1, sizeof(table));
+    for (png_uint_32 y = 0; y < height; y++) {
+        const png_byte* row = rgb_rows[y];
+        for (png_uint_32 x = 0; x < width; x++) {
+            const png_byte* p = &row[3 * x];
+            if (gray && (p[0] != p[1] || p[1] != p[2]))
+                gray = 0;
+            // a gray level survives depth d when it is a multiple of 255/(2^d-1)
+            while (gray && gray_depth < 8 && p[0] % (255 / ((1 << gray_depth) - 1)))
+                gray_depth *= 2;
+            png_uint_32 rgb = ((png_uint_32)p[0] << 16) | (p[1] << 8) | p[2];
+            if (colors >= 0 && optimize_palette_index(table, palette, &colors, rgb) < 0)
+                colors = -1;
+        }
+    }
+
+    job->format_count = 0;
+    if (gray) {
+        OptimizeFormat* f = &job->formats[job->format_count++];
+        f->opts = native_default_options;
+        f->opts.bit_depth = gray_depth;
+        f->opts.color_type = PNG_COLOR_TYPE_GRAY;
+        if (optimize_pack(f, &ctx->packed[0], width, height, 1, gray_depth))
+            return -1;
+        int scale = 255 / ((1 << gray_depth) - 1);
+        for (png_uint_32 y = 0; y < height; y++)
+            for (png_uint_32 x = 0; x < width; x++)
+                optimize_put_sample(f->rows[y], x, gray_depth, rgb_rows[y][3 * x] / scale);
+    } else {
+        OptimizeFormat* f = &job->formats[job->format_count++];
+        f->opts = native_default_options;
+        f->rows = rgb_rows;
+    }
+
+    // a palette only pays off when its index depth beats the format above
+    int current_bits = gray ? gray_depth : 24;
+    if (colors > 0 && optimize_depth_for(colors) < current_bits) {
+        OptimizeFormat* f = &job->formats[job->format_count++];
+        int depth = optimize_depth_for(colors);
+        memcpy(f->palette, palette, 3 * colors);
+        f->opts = native_default_options;
+        f->opts.bit_depth = depth;
+        f->opts.color_type = PNG_COLOR_TYPE_PALETTE;
+        f->opts.palette = f->palette;
+        f->opts.palette_size = colors;
+        if (optimize_pack(f, &ctx->packed[1], width, height, 1, depth))
+            return -1;
+        for (png_uint_32 y = 0; y < height; y++)
+            for (png_uint_32 x = 0; x < width; x++) {
+                const png_byte* p = &rgb_rows[y][3 * x];
+                int index = optimize_palette_index(table, f->palette, &colors,
+                                ((png_uint_32)p[0] << 16) | (p[1] << 8) | p[2]);
+                optimize_put_sample(f->rows[y], x, depth, index);
+            }
+    }
+    return 0;
+}
+
+// smallest zlib window that still covers the whole filtered image; a window
+// at least as large as the data compresses identically to a 32K one
+static int optimize_window_bits(const EncodeOptions* opts, png_uint_32 width, png_uint_32 height) {
+    int channels = opts->color_type == PNG_COLOR_TYPE_PALETTE ? 1 : native_channels(opts->color_type);
+    size_t raw = (((size_t)width * channels * opts->bit_depth + 7) / 8 + 1) * height;
+    int bits = 9;
+    while (bits < 15 && ((size_t)1 << bits) < raw + 262)
+        bits++;
+    return bits;
+}
+
+// encodes an 8 bit RGB image with every candidate format and setting and
+// writes the smallest result to fp. Returns the number of bytes written.
+long optimize_write_png(FILE* fp, png_bytep* rgb_rows, png_uint_32 width, png_uint_32 height) {
+    // the job lives on this thread's stack; convert_parallel returns only
+    // once every trial is done with it
+    OptimizeJob job_storage;
+    OptimizeJob* job = &job_storage;
+    memset(job, 0, sizeof(*job));
+    job->width = width;
+    job->height = height;
+    long written = -1;
+    if (optimize_formats(job, rgb_rows) == 0) {
+        int trials = job->format_count * OPTIMIZE_TRIALS_PER_FORMAT;
+        convert_parallel(trials, optimize_trial, job);
+
+        int best = 0;
+        for (int i = 1; i < trials; i++)
+            if (job->sizes[i] < job->sizes[best])
+                best = i;
+        if (job->sizes[best] != (size_t)-1) {
+            EncodeOptions opts;
+            optimize_trial_options(job, best, &opts);
+            opts.window_bits = optimize_window_bits(&opts, width, height);
+            long start = ftell(fp);
+            if (native_write_png(convert_context(), fp, job->formats[best / OPTIMIZE_TRIALS_PER_FORMAT].rows,
+                                 width, height, &opts) == 0)
+                written = ftell(fp) - start;
+        }
+    }
+    return written;
+}
+
+/////////////////////////////////////////////////////
+// libpng reader and writer, used for files the native codec does not handle
+// and when the libpng codec is selected
+/////////////////////////////////////////////////////
+
+// libpng's error handler: keeps the message for the failure report and
+// returns to the setjmp of the function that was running
+static void convert_png_error(png_structp png_ptr, png_const_charp message) {
+    ConvertContext* ctx = convert_context();
+    snprintf(ctx->error, sizeof(ctx->error), "%s", message);
+    png_longjmp(png_ptr, 1);
+}
+
+// libpng's per-row callbacks: stop a conversion the watchdog cancelled
+static void convert_png_read_row(png_structp png_ptr, png_uint_32 row, int pass) {
+    if (convert_cancelled(convert_context()))
+        png_error(png_ptr, "cancelled by the watchdog");
+}
+
+static void convert_png_write_row(png_structp png_ptr, png_uint_32 row, int pass) {
+    if (convert_cancelled(convert_context()))
+        png_error(png_ptr, "cancelled by the watchdog");
+}
+
+// reads the rest of an image whose signature has already been consumed,
+// setting *rows to its rows in buffer. expand asks libpng to turn palette,
+// low bit depth, 16 bit and gray images into 8 bit RGB(A) so the optimizer
+// can take any PNG as input.
+int libpng_read_png(ConvertContext* ctx, ConvertBuffer* buffer, FILE* fp, int expand, png_bytep** rows,
+                    png_uint_32* width, png_uint_32* height, png_uint_32* bit_depth, png_uint_32* color_type) {
     png_structp png_ptr_rd;   // pointer to png read struct
-    png_infop info_ptr_rd;    // poiner to png read header struct
-    png_structp png_ptr_wr;   // pointer to png write struct
-    png_infop info_ptr_wr;    // poiner to png write header struct
-    png_uint_32 width, height, bit_depth, color_type, interlace_type, number_of_passes;
+    png_infop info_ptr_rd = NULL; // poiner to png read header struct
     png_bytep * row_pointers; // pointer to image payload
-    char header[8];           // to read magic number of 8 bytes
+    unsigned char ihdr[16];   // length, type, width and height of IHDR
 
-    // open file and test for it being a png
-    FILE *fp = fopen(fn_in, "rb");
-    if (!fp)
-        abort_("[fopen] fopen");
-    fread(header, 1, 8, fp); // read magic number
-    if (png_sig_cmp(header, 0, 8))
-        abort_("[png_sig_comp] not a PNG file");
+    // refuse an image over the limits before libpng sets anything up for
+    // it: libpng's own user limits only end in "Invalid IHDR data"
+    long start = ftell(fp);
+    if (fread(ihdr, 1, sizeof(ihdr), fp) == sizeof(ihdr) && !memcmp(ihdr + 4, "IHDR", 4) &&
+        !convert_within_limits(native_get_u32(ihdr + 8), native_get_u32(ihdr + 12)))
+        return convert_fail(CONVERT_ERR_LIMIT, "[libpng_read_png] %ux%u image is over the limits",
+                            native_get_u32(ihdr + 8), native_get_u32(ihdr + 12));
+    if (fseek(fp, start, SEEK_SET))
+        return convert_fail(CONVERT_ERR_OPEN, "[libpng_read_png] cannot rewind the input");
 
     // initialize png read structs
-    if((png_ptr_rd = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL))==0)
-        abort_("[png_create_read_struct] failed");
+    if (convert_arena)
+        png_ptr_rd = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, convert_png_error, NULL, &ctx->arena,
+                                              convert_arena_malloc, convert_arena_free);
+    else
+        png_ptr_rd = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, convert_png_error, NULL, NULL,
+                                              convert_heap_malloc, convert_heap_free);
+    if (png_ptr_rd == 0)
+        return convert_fail(CONVERT_ERR_MEMORY, "[png_create_read_struct] failed");
 
-    if((info_ptr_rd = png_create_info_struct(png_ptr_rd))==0)
-        abort_("[png_create_info_struct] failed");
+    if((info_ptr_rd = png_create_info_struct(png_ptr_rd))==0) {
+        png_destroy_read_struct(&png_ptr_rd, NULL, NULL);
+        convert_arena_reset(&ctx->arena);
+        return convert_fail(CONVERT_ERR_MEMORY, "[png_create_info_struct] failed");
+    }
 
-    if (setjmp(png_jmpbuf(png_ptr_rd)))
-        abort_("[init_io] failed");
+    // any libpng error from here on lands back here
+    if (setjmp(png_jmpbuf(png_ptr_rd))) {
+        png_destroy_read_struct(&png_ptr_rd, &info_ptr_rd, NULL);
+        convert_arena_reset(&ctx->arena);
+        if (convert_cancelled(ctx))
+            return convert_fail(CONVERT_ERR_TIMEOUT, "[libpng_read_png] over the %gs CPU limit", convert_cpu_limit);
+        return convert_fail(CONVERT_ERR_CORRUPT, "[libpng_read_png] %s", ctx->error);
+    }
 
     png_init_io(png_ptr_rd, fp);
     png_set_sig_bytes(png_ptr_rd, 8);
+    png_set_user_limits(png_ptr_rd, convert_max_width, convert_max_height);
+    png_set_chunk_malloc_max(png_ptr_rd, convert_max_chunk);
+    png_set_chunk_cache_max(png_ptr_rd, convert_max_chunks);
+    png_set_read_status_fn(png_ptr_rd, convert_png_read_row);
     //load structs
     png_read_info(png_ptr_rd, info_ptr_rd);
-    //get local variable copies from structs
-    width = png_get_image_width(png_ptr_rd, info_ptr_rd);
-    height = png_get_image_height(png_ptr_rd, info_ptr_rd);
-    color_type = png_get_color_type(png_ptr_rd, info_ptr_rd);
-    bit_depth = png_get_bit_depth(png_ptr_rd, info_ptr_rd);
+    // the gray conversion averages 8 bit samples
+    png_set_strip_16(png_ptr_rd);
+    if (expand) {
+        png_set_expand(png_ptr_rd);
+        png_set_gray_to_rgb(png_ptr_rd);
+    }
 
     //for inflating
-    number_of_passes = png_set_interlace_handling(png_ptr_rd);
+    png_set_interlace_handling(png_ptr_rd);
     png_read_update_info(png_ptr_rd, info_ptr_rd);
+    //get local variable copies from structs
+    *width = png_get_image_width(png_ptr_rd, info_ptr_rd);
+    *height = png_get_image_height(png_ptr_rd, info_ptr_rd);
+    *color_type = png_get_color_type(png_ptr_rd, info_ptr_rd);
+    *bit_depth = png_get_bit_depth(png_ptr_rd, info_ptr_rd);
 
-    // read file
-    if (setjmp(png_jmpbuf(png_ptr_rd)))
-        abort_("png_jmpbuf: error read_image");
-    // allocated array of row pointers
-    row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    // allocated each row to read data into
-    for (int y=0; y<height; y++)
-            row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr_rd,info_ptr_rd));
+    // rows go into the caller's buffer
+    row_pointers = convert_buffer_rows(buffer, *height, png_get_rowbytes(png_ptr_rd, info_ptr_rd));
+    if (!row_pointers) {
+        png_destroy_read_struct(&png_ptr_rd, &info_ptr_rd, NULL);
+        convert_arena_reset(&ctx->arena);
+        if (buffer->external)
+            return CONVERT_ERR_TOO_BIG;
+        return convert_fail(CONVERT_ERR_MEMORY, "[libpng_read_png] out of memory");
+    }
     // read image into the 2D array
     png_read_image(png_ptr_rd, row_pointers);
-    // done reading so close file
-    fclose(fp);
-    //check the file format is RBG to access it as [][][] with 0-255 values
-    if (png_get_color_type(png_ptr_rd, info_ptr_rd) != PNG_COLOR_TYPE_RGB)
-        abort_("must be a RGB file");
-    //finally convert the image's bits to grayscale
+
+    //read memory clean up
+    png_destroy_read_struct(&png_ptr_rd, &info_ptr_rd, NULL);
+    convert_arena_reset(&ctx->arena);
+    *rows = row_pointers;
+    return CONVERT_OK;
+}
+
+int libpng_write_png(FILE* fp_out, png_bytep* row_pointers, png_uint_32 width, png_uint_32 height,
+                     png_uint_32 bit_depth, png_uint_32 color_type) {
+    png_structp png_ptr_wr;   // pointer to png write struct
+    png_infop info_ptr_wr = NULL; // poiner to png write header struct
+    ConvertContext* ctx = convert_context();
+
+    // initialize and check write structs
+    if (convert_arena)
+        png_ptr_wr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, convert_png_error, NULL, &ctx->arena,
+                                               convert_arena_malloc, convert_arena_free);
+    else
+        png_ptr_wr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, convert_png_error, NULL, NULL,
+                                               convert_heap_malloc, convert_heap_free);
+    if (!png_ptr_wr)
+            return convert_fail(CONVERT_ERR_MEMORY, "[write_png_file] png_create_write_struct failed");
+
+    if (!(info_ptr_wr = png_create_info_struct(png_ptr_wr))) {
+            png_destroy_write_struct(&png_ptr_wr, NULL);
+            convert_arena_reset(&ctx->arena);
+            return convert_fail(CONVERT_ERR_MEMORY, "[write_png_file] png_create_info_struct failed");
+    }
+
+    // any libpng error from here on lands back here
+    if (setjmp(png_jmpbuf(png_ptr_wr))) {
+            png_destroy_write_struct(&png_ptr_wr, &info_ptr_wr);
+            convert_arena_reset(&ctx->arena);
+            if (convert_cancelled(ctx))
+                return convert_fail(CONVERT_ERR_TIMEOUT, "[write_png_file] over the %gs CPU limit", convert_cpu_limit);
+            return convert_fail(CONVERT_ERR_WRITE, "[write_png_file] %s", ctx->error);
+    }
+
+    png_init_io(png_ptr_wr, fp_out);
+    png_set_write_status_fn(png_ptr_wr, convert_png_write_row);
+
+
+    // write header
+    png_set_IHDR(png_ptr_wr, info_ptr_wr, width, height,
+                 bit_depth, color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    // libpng writes one IDAT chunk per compression buffer
+    png_set_compression_buffer_size(png_ptr_wr,
+        convert_zbuf_for((png_get_rowbytes(png_ptr_wr, info_ptr_wr) + 1) * height));
+    int degrade = __atomic_load_n(&convert_degrade, __ATOMIC_RELAXED);
+    if (degrade >= CONVERT_DEGRADE_FAST)
+        png_set_compression_level(png_ptr_wr, Z_BEST_SPEED);
+    if (degrade >= CONVERT_DEGRADE_FASTEST) {
+        png_set_filter(png_ptr_wr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+        png_set_compression_strategy(png_ptr_wr, Z_RLE);
+    }
+
+    png_write_info(png_ptr_wr, info_ptr_wr);
+
+
+    // write bytes
+     png_write_image(png_ptr_wr, row_pointers);
+
+
+    // end write
+    png_write_end(png_ptr_wr, NULL);
+    //write memory clean up
+    png_destroy_write_struct(&png_ptr_wr, &info_ptr_wr);
+    convert_arena_reset(&ctx->arena);
+    return CONVERT_OK;
+}
+
+// bytes between rows of an image laid out by convert_buffer_rows
+size_t convert_row_stride(const ConvertImage* image) {
+    int channels = image->color_type == PNG_COLOR_TYPE_PALETTE ? 1 : native_channels(image->color_type);
+    size_t rowbytes = ((size_t)image->width * channels * image->bit_depth + 7) / 8;
+    return (rowbytes + 63) & ~(size_t)63;
+}
+
+// turns 8 bit RGB rows gray in place
+static void convert_gray_rows(png_bytep* row_pointers, png_uint_32 width, png_uint_32 height) {
+    int avg;                  //agerage rgb pixel value
     for (int y=0; y<height; y++) {
         png_byte* row = row_pointers[y];
         for (int x=0; x<width; x++) {
@@ -104,69 +1938,509 @@ int colorConvert(int argv, char* argc[]){
             ptr[2] = avg;
         }
     }
-    /////////////////////////////////////////////////////
-    // start of convert and write image file out section
-    // convert the image to grayscale and write it out as a new file.
-    /////////////////////////////////////////////////////
+}
+
+// first half of colorConvert: decodes fn_in into buffer and turns it gray
+// in place, setting *rows to the row pointers. Returns
+// CONVERT_ERR_TOO_BIG, before anything is decoded into it, when the image
+// does not fit an external buffer.
+int convert_decode_gray(ConvertContext* ctx, const char* fn_in, ConvertBuffer* buffer, ConvertImage* image,
+                        png_bytep** rows) {
+    png_uint_32 width, height, bit_depth, color_type;
+    png_bytep * row_pointers = NULL; // pointer to image payload
+    char header[8];           // to read magic number of 8 bytes
+    int native = 0;           // image was decoded by the native reader
+    int rc;
+
+    // open file and test for it being a png
+    FILE *fp = fopen(fn_in, "rb");
+    if (!fp)
+        return convert_fail(CONVERT_ERR_OPEN, "[fopen] %s", fn_in);
+    // libpng feeds inflate from fread in 8K pieces (PNG_IDAT_READ_SIZE is
+    // fixed when libpng16.a is built); a larger stdio buffer at least turns
+    // those into fewer, larger reads
+    if (convert_codec == CONVERT_CODEC_LIBPNG)
+        setvbuf(fp, NULL, _IOFBF, convert_zbuf_for(0));
+    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) {
+        fclose(fp);
+        return convert_fail(CONVERT_ERR_FORMAT, "[png_sig_comp] %s: not a PNG file", fn_in);
+    }
+
+    if (convert_codec == CONVERT_CODEC_NATIVE) {
+        rc = native_read_header(ctx, fp, &width, &height, &bit_depth, &color_type);
+        if (rc < 0) {
+            fclose(fp);
+            return convert_fail(CONVERT_ERR_CORRUPT, "[native_read_header] %s: corrupt PNG header", fn_in);
+        }
+        if (!convert_within_limits(width, height)) {
+            fclose(fp);
+            return convert_fail(CONVERT_ERR_LIMIT, "[native_read_header] %s: %ux%u image is over the limits",
+                                fn_in, width, height);
+        }
+        if (rc == 0)
+            native = 1;
+        else if (fseek(fp, 8, SEEK_SET)) {
+            fclose(fp);
+            return convert_fail(CONVERT_ERR_OPEN, "[fseek] %s", fn_in);
+        }
+    }
+
+    if (native) {
+        row_pointers = convert_buffer_rows(buffer, height, (size_t)width * 3);
+        if (!row_pointers) {
+            fclose(fp);
+            if (buffer->external)
+                return CONVERT_ERR_TOO_BIG;
+            return convert_fail(CONVERT_ERR_MEMORY, "[colorConvert] %s: out of memory", fn_in);
+        }
+        rc = native_read_rows(ctx, fp, row_pointers, width, height);
+        if (rc < 0 && convert_cancelled(ctx)) {
+            fclose(fp);
+            return convert_timeout(fn_in);
+        }
+        if (rc < 0) {
+            fclose(fp);
+            return convert_fail(CONVERT_ERR_CORRUPT, "[native_read_rows] %s: error reading image data", fn_in);
+        }
+        if (rc > 0) {
+            // restart index did not match the data; let libpng read it
+            native = 0;
+            if (fseek(fp, 8, SEEK_SET)) {
+                fclose(fp);
+                return convert_fail(CONVERT_ERR_OPEN, "[fseek] %s", fn_in);
+            }
+        }
+    }
+    if (!native) {
+        if (buffer->external) {
+            // libpng reports what it needs only once it is reading
+            ConvertImage probe;
+            if (convert_peek_header(fn_in, &probe, NULL) ||
+                convert_row_stride(&probe) * probe.height > buffer->size) {
+                fclose(fp);
+                return CONVERT_ERR_TOO_BIG;
+            }
+        }
+        rc = libpng_read_png(ctx, buffer, fp, 0, &row_pointers, &width, &height, &bit_depth, &color_type);
+        if (rc != CONVERT_OK) {
+            fclose(fp);
+            return rc;
+        }
+    }
+    // done reading so close file
+    fclose(fp);
+    //check the file format is RBG to access it as [][][] with 0-255 values
+    if (color_type != PNG_COLOR_TYPE_RGB)
+        return convert_fail(CONVERT_ERR_FORMAT, "%s: must be a RGB file", fn_in);
+    //finally convert the image's bits to grayscale
+    convert_gray_rows(row_pointers, width, height);
+    image->width = width;
+    image->height = height;
+    image->bit_depth = bit_depth;
+    image->color_type = color_type;
+    *rows = row_pointers;
+    return CONVERT_OK;
+}
+
+// the native writer's settings for an output, after degradation
+static void convert_native_options(EncodeOptions* opts, int degrade) {
+    *opts = native_default_options;
+    opts->restart_rows = convert_restart_rows;
+    if (degrade >= CONVERT_DEGRADE_FAST)
+        opts->level = Z_BEST_SPEED;
+    if (degrade >= CONVERT_DEGRADE_FASTEST) {
+        opts->filter = PNG_FILTER_VALUE_SUB;
+        opts->strategy = Z_RLE;
+    }
+}
+
+// second half of colorConvert: writes the converted rows to fn_out with
+// the configured writer. A failed write leaves no partial output behind.
+int convert_encode(ConvertContext* ctx, const char* fn_out, png_bytep* row_pointers, const ConvertImage* image) {
+    png_uint_32 width = image->width, height = image->height;
+    png_uint_32 bit_depth = image->bit_depth, color_type = image->color_type;
+    int rc = CONVERT_OK;
 
     FILE *fp_out = fopen(fn_out, "wb");
     if (!fp_out)
-            abort_("[write_png_file] File %s could not be opened for writing", fn_out);
-
+        return convert_fail(CONVERT_ERR_WRITE, "[write_png_file] File %s could not be opened for writing", fn_out);
 
-    // initialize and check write structs
-    png_ptr_wr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    info_ptr_wr = png_create_info_struct(png_ptr_wr);
+    int degrade = __atomic_load_n(&convert_degrade, __ATOMIC_RELAXED);
+    if (convert_optimize && bit_depth == 8 && degrade == CONVERT_DEGRADE_NONE) {
+        long size = optimize_write_png(fp_out, row_pointers, width, height);
+        if (size < 0 && !convert_cancelled(ctx))
+            rc = convert_fail(CONVERT_ERR_WRITE, "[optimize_write_png] Error writing %s", fn_out);
+        else if (size < 0)
+            rc = CONVERT_ERR_TIMEOUT;
+        else
+            __atomic_add_fetch(&optimize_bytes_after, size, __ATOMIC_RELAXED);
+    } else if (convert_codec == CONVERT_CODEC_NATIVE && bit_depth == 8) {
+        EncodeOptions opts;
+        convert_native_options(&opts, degrade);
+        if (native_write_png(ctx, fp_out, row_pointers, width, height, &opts))
+            rc = convert_cancelled(ctx) ? CONVERT_ERR_TIMEOUT
+                                        : convert_fail(CONVERT_ERR_WRITE, "[native_write_png] Error writing %s", fn_out);
+    } else {
+        rc = libpng_write_png(fp_out, row_pointers, width, height, bit_depth, color_type);
+    }
+    if (fclose(fp_out) && rc == CONVERT_OK)
+        rc = convert_fail(CONVERT_ERR_WRITE, "[fclose] Error writing %s", fn_out);
+    if (rc != CONVERT_OK && convert_cancelled(ctx))
+        rc = convert_timeout(fn_out);
+    if (rc != CONVERT_OK)
+        unlink(fn_out);
+    return rc;
+}
 
-    if (!png_ptr_wr)
-            abort_("[write_png_file] png_create_write_struct failed");
+// converts argc[1] to grayscale in argc[2]; returns CONVERT_OK or the
+// CONVERT_ERR_* code of what went wrong
+int colorConvert(int argv, char* argc[]){
+    if (argv != 3)
+        return convert_fail(CONVERT_ERR_USAGE, "usage: <executable> <input file> <output file>");
+    char* fn_in = argc[1];
+    char* fn_out= argc[2];
+    ConvertContext* ctx = convert_context();
+    ConvertImage image;
+    png_bytep* row_pointers;
 
-    if (!info_ptr_wr)
-            abort_("[write_png_file] png_create_info_struct failed");
+    // rows live in the thread's image buffer, kept for the next image
+    convert_watch_begin(ctx);
+    int rc = convert_decode_gray(ctx, fn_in, &ctx->image, &image, &row_pointers);
+    if (rc == CONVERT_OK)
+        rc = convert_encode(ctx, fn_out, row_pointers, &image);
+    convert_watch_end(ctx);
+    return rc;
+}
 
-    if (setjmp(png_jmpbuf(png_ptr_wr)))
-            abort_("[write_png_file] Error during init_io");
+/////////////////////////////////////////////////////
+// progressive decoding: rather than pulling the file through fread,
+// libpng's progressive reader is handed the data a piece at a time
+// (png_process_data) as the caller gets it, so one thread can keep many
+// decodes going and move on whenever one runs out of input. A decoder
+// owns its image buffer, kept from one file to the next, and its libpng
+// allocations come from the heap since the thread's arena and image
+// buffer serve one image at a time.
+//
+// Rows of a non-interlaced image are turned gray in the row callback as
+// they arrive, and when the native writer would write the output anyway
+// (no optimizer, no restart index) they are also filtered and deflated
+// into it there, so the output is all but written by the time the last
+// byte of the input comes in. Since one thread may be streaming several
+// outputs at once, each decoder has a deflate stream of its own for this.
+// Interlaced images, whose rows are only final after the last pass, and
+// the other writers, wait for the whole image.
+/////////////////////////////////////////////////////
 
-    png_init_io(png_ptr_wr, fp_out);
+typedef struct ConvertProgressive {
+    png_structp png;
+    png_infop info;
+    const char* fn_in;
+    ConvertBuffer buffer;
+    ConvertImage image;
+    png_bytep* rows;
+    int rc;                     // set by a callback that refuses the image
+    int done;                   // the end of the image has been seen
+    size_t bytes;               // fed so far
+    unsigned char head[24];     // signature and the start of IHDR
+    size_t unused;              // bytes of the last feed past the image's end
+    double cpu;                 // thread CPU seconds its feeds have taken
+    int interlaced;
+    const char* fn_out;
+    FILE* out;                  // output being written row by row, or NULL
+    ConvertContext* encoder;    // its deflate stream and scratch
+    size_t rowbytes;
+    int filter;
+} ConvertProgressive;
 
+// starts writing the output as rows arrive, when the native writer would
+// write it with these settings anyway; returns -1 on a write error
+static int convert_progressive_stream(ConvertProgressive* p) {
+    EncodeOptions opts;
+    int degrade = __atomic_load_n(&convert_degrade, __ATOMIC_RELAXED);
+    convert_native_options(&opts, degrade);
+    if (p->interlaced || p->image.bit_depth != 8 || convert_codec != CONVERT_CODEC_NATIVE ||
+        (convert_optimize && degrade == CONVERT_DEGRADE_NONE) || opts.restart_rows)
+        return 0;
+    if (!p->encoder && (p->encoder = calloc(1, sizeof(*p->encoder))) == NULL)
+        return 0;
+    p->rowbytes = (size_t)p->image.width * 3;
+    p->filter = opts.filter;
+    if ((p->out = fopen(p->fn_out, "wb")) == NULL)
+        return -1;
+    if (native_encode_setup(p->encoder, p->rowbytes, p->image.height, &opts))
+        return -1;
+    native_deflate_header(p->encoder, &opts);
+    return native_write_ihdr(p->out, p->image.width, p->image.height, &opts);
+}
 
-    // write header
-    if (setjmp(png_jmpbuf(png_ptr_wr)))
-            abort_("[write_png_file] Error during writing header");
+// header callback: checks the image and lays out its rows
+static void convert_progressive_info(png_structp png_ptr, png_infop info_ptr) {
+    ConvertProgressive* p = png_get_progressive_ptr(png_ptr);
+    png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+    if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB) {
+        p->rc = convert_fail(CONVERT_ERR_FORMAT, "%s: must be a RGB file", p->fn_in);
+        png_longjmp(png_ptr, 1);
+    }
+    png_set_strip_16(png_ptr);
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    p->image.width = width;
+    p->image.height = height;
+    p->image.bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    p->image.color_type = PNG_COLOR_TYPE_RGB;
+    p->interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+    p->rows = convert_buffer_rows(&p->buffer, height, png_get_rowbytes(png_ptr, info_ptr));
+    if (!p->rows) {
+        p->rc = convert_fail(CONVERT_ERR_MEMORY, "[convert_progressive] %s: out of memory", p->fn_in);
+        png_longjmp(png_ptr, 1);
+    }
+    if (p->fn_out && convert_progressive_stream(p)) {
+        p->rc = convert_fail(CONVERT_ERR_WRITE, "[write_png_file] File %s could not be written", p->fn_out);
+        png_longjmp(png_ptr, 1);
+    }
+}
 
-    png_set_IHDR(png_ptr_wr, info_ptr_wr, width, height,
-                 bit_depth, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+// row callback: interlaced images arrive a pass at a time and are merged
+// into the rows; new_row is NULL for rows a pass leaves alone
+static void convert_progressive_row(png_structp png_ptr, png_bytep new_row, png_uint_32 row, int pass) {
+    ConvertProgressive* p = png_get_progressive_ptr(png_ptr);
+    if (!new_row)
+        return;
+    png_progressive_combine_row(png_ptr, p->rows[row], new_row);
+    if (p->interlaced)
+        return;
+    convert_gray_rows(&p->rows[row], p->image.width, 1);
+    if (p->out && native_encode_row(p->encoder, p->out, p->rows[row], row ? p->rows[row - 1] : NULL,
+                                    p->rowbytes, 3, p->filter, 0)) {
+        p->rc = convert_fail(CONVERT_ERR_WRITE, "[native_write_png] Error writing %s", p->fn_out);
+        png_longjmp(png_ptr, 1);
+    }
+}
 
-    png_write_info(png_ptr_wr, info_ptr_wr);
+// end callback: whatever follows the image in the same feed is left for
+// the caller, who may have the next image coming down the same stream
+static void convert_progressive_end(png_structp png_ptr, png_infop info_ptr) {
+    ConvertProgressive* p = png_get_progressive_ptr(png_ptr);
+    p->done = 1;
+    p->unused = png_process_data_pause(png_ptr, 0);
+}
 
+// starts decoding fn_in, whose data, signature included, is then passed
+// to convert_progressive_feed. With fn_out set, the output is written
+// while the data comes in where that is possible, and by
+// convert_progressive_finish otherwise.
+int convert_progressive_begin(ConvertProgressive* p, const char* fn_in, const char* fn_out) {
+    p->fn_in = fn_in;
+    p->fn_out = fn_out;
+    p->rows = NULL;
+    p->rc = CONVERT_OK;
+    p->done = 0;
+    p->bytes = 0;
+    p->unused = 0;
+    p->cpu = 0;
+    p->interlaced = 0;
+    p->out = NULL;
+    memset(&p->image, 0, sizeof(p->image));
+    p->png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, convert_png_error, NULL, NULL,
+                                      convert_heap_malloc, convert_heap_free);
+    if (!p->png)
+        return convert_fail(CONVERT_ERR_MEMORY, "[png_create_read_struct] failed");
+    if (!(p->info = png_create_info_struct(p->png))) {
+        png_destroy_read_struct(&p->png, NULL, NULL);
+        return convert_fail(CONVERT_ERR_MEMORY, "[png_create_info_struct] failed");
+    }
+    png_set_user_limits(p->png, convert_max_width, convert_max_height);
+    png_set_chunk_malloc_max(p->png, convert_max_chunk);
+    png_set_chunk_cache_max(p->png, convert_max_chunks);
+    png_set_progressive_read_fn(p->png, p, convert_progressive_info, convert_progressive_row,
+                                convert_progressive_end);
+    return CONVERT_OK;
+}
 
-    // write bytes
-    if (setjmp(png_jmpbuf(png_ptr_wr)))
-            abort_("[write_png_file] Error during writing bytes");
+// hands the next size bytes of the file to the decoder. Once it is done,
+// p->unused of them were past the end of the image.
+int convert_progressive_feed(ConvertProgressive* p, unsigned char* data, size_t size) {
+    // refuse a file that is not a PNG, or an image over the limits, before
+    // libpng sees it, as libpng_read_png does: libpng's own checks only end
+    // in errors that read as corrupt files
+    if (p->bytes < sizeof(p->head)) {
+        size_t n = sizeof(p->head) - p->bytes < size ? sizeof(p->head) - p->bytes : size;
+        memcpy(p->head + p->bytes, data, n);
+        if (p->bytes < 8 && png_sig_cmp(p->head, 0, p->bytes + n < 8 ? p->bytes + n : 8))
+            return convert_fail(CONVERT_ERR_FORMAT, "[png_sig_comp] %s: not a PNG file", p->fn_in);
+        if (p->bytes + n == sizeof(p->head) && !memcmp(p->head + 12, "IHDR", 4) &&
+            !convert_within_limits(native_get_u32(p->head + 16), native_get_u32(p->head + 20)))
+            return convert_fail(CONVERT_ERR_LIMIT, "[convert_progressive] %s: %ux%u image is over the limits",
+                                p->fn_in, native_get_u32(p->head + 16), native_get_u32(p->head + 20));
+    }
+    if (setjmp(png_jmpbuf(p->png))) {
+        if (p->rc != CONVERT_OK)
+            return p->rc;
+        return convert_fail(CONVERT_ERR_CORRUPT, "[convert_progressive] %s: %s", p->fn_in,
+                            convert_context()->error);
+    }
+    // files share the thread, so the CPU limit is counted per file across
+    // its feeds rather than by the watchdog, which times whole threads
+    double cpu = convert_cpu_limit > 0 ? convert_cpu_seconds(CLOCK_THREAD_CPUTIME_ID) : 0;
+    png_process_data(p->png, p->info, data, size);
+    p->bytes += size - p->unused;
+    if (convert_cpu_limit > 0) {
+        p->cpu += convert_cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        if (p->cpu > convert_cpu_limit)
+            return convert_timeout(p->fn_in);
+    }
+    return CONVERT_OK;
+}
 
-     png_write_image(png_ptr_wr, row_pointers);
+// once the image has been fed, writes what is left of the output. A
+// failed conversion leaves no partial output behind.
+int convert_progressive_finish(ConvertProgressive* p) {
+    if (p->bytes < 8)
+        return convert_fail(CONVERT_ERR_FORMAT, "[png_sig_comp] %s: not a PNG file", p->fn_in);
+    if (!p->done)
+        return convert_fail(CONVERT_ERR_CORRUPT, "[convert_progressive] %s: file ends %s", p->fn_in,
+                            p->rows ? "before the end of its image data" : "before its image data");
+    if (p->out) {
+        int rc = native_deflate(p->encoder, p->out, NULL, 0, Z_FINISH) ||
+                 native_write_chunk(p->out, "IEND", NULL, 0);
+        rc |= fclose(p->out);
+        p->out = NULL;
+        if (rc) {
+            unlink(p->fn_out);
+            return convert_fail(CONVERT_ERR_WRITE, "[native_write_png] Error writing %s", p->fn_out);
+        }
+        return CONVERT_OK;
+    }
+    if (p->interlaced)
+        convert_gray_rows(p->rows, p->image.width, p->image.height);
+    // the encode runs in one go, so the watchdog can time it
+    ConvertContext* ctx = convert_context();
+    convert_watch_begin(ctx);
+    int rc = convert_encode(ctx, p->fn_out, p->rows, &p->image);
+    convert_watch_end(ctx);
+    return rc;
+}
 
+// drops the libpng state of the current file and any output it left
+// unfinished; with release, the image buffer and deflate stream go too
+void convert_progressive_free(ConvertProgressive* p, int release) {
+    if (p->png)
+        png_destroy_read_struct(&p->png, &p->info, NULL);
+    p->png = NULL;
+    p->info = NULL;
+    if (p->out) {
+        fclose(p->out);
+        unlink(p->fn_out);
+        p->out = NULL;
+    }
+    if (release) {
+        convert_buffer_release(&p->buffer);
+        if (p->encoder)
+            convert_context_free(p->encoder);
+        p->encoder = NULL;
+    }
+}
 
-    // end write
-    if (setjmp(png_jmpbuf(png_ptr_wr)))
-            abort_("[write_png_file] Error during end of write");
+// decodes the optimizer's output fn and checks it holds exactly the 8 bit
+// RGB samples of rows
+static int optimize_same_pixels(ConvertContext* ctx, const char* fn, png_bytep* rows, png_uint_32 width,
+                                png_uint_32 height) {
+    char header[8];
+    png_uint_32 w, h, bit_depth, color_type;
+    png_bytep* check;
+    FILE* fp = fopen(fn, "rb");
+    if (!fp)
+        return 0;
+    int rc = fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8) ? CONVERT_ERR_FORMAT
+             : libpng_read_png(ctx, &ctx->packed[0], fp, 1, &check, &w, &h, &bit_depth, &color_type);
+    fclose(fp);
+    if (rc != CONVERT_OK || w != width || h != height || bit_depth != 8 || color_type != PNG_COLOR_TYPE_RGB)
+        return 0;
+    for (png_uint_32 y = 0; y < height; y++)
+        if (memcmp(check[y], rows[y], (size_t)width * 3))
+            return 0;
+    return 1;
+}
 
-    png_write_end(png_ptr_wr, NULL);
-    //write memory clean up
-    png_destroy_write_struct(&png_ptr_wr, &info_ptr_wr);
-    fclose(fp_out);
-    /////////////////////////////////////////////////////
-    // end of convert and write image file out section
-    ////////////////////////////////////////////////////
+// optimizeConvert's work on one file
+static int optimize_convert_file(ConvertContext* ctx, const char* fn) {
+    char fn_tmp[4096];
+    char header[8];
+    png_uint_32 width, height, bit_depth, color_type;
+    png_bytep* row_pointers;
+    ConvertImage peek;
+    size_t file_size;
 
-    //read memory clean up
-    png_destroy_read_struct(&png_ptr_rd, &info_ptr_rd, NULL);
+    // the optimizer works on 8 bit samples; reading a 16 bit file for it
+    // would throw half of each sample away
+    if (convert_peek_header(fn, &peek, &file_size) == 0 && peek.bit_depth == 16) {
+        fprintf(stderr, "%s: 16 bit, left as is\n", fn);
+        __atomic_add_fetch(&optimize_bytes_before, file_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&optimize_bytes_after, file_size, __ATOMIC_RELAXED);
+        return CONVERT_OK;
+    }
+    FILE* fp = fopen(fn, "rb");
+    if (!fp)
+        return convert_fail(CONVERT_ERR_OPEN, "[fopen] %s", fn);
+    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) {
+        fclose(fp);
+        return convert_fail(CONVERT_ERR_FORMAT, "[png_sig_comp] %s: not a PNG file", fn);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size_before = ftell(fp);
+    fseek(fp, 8, SEEK_SET);
+    int rc = libpng_read_png(ctx, &ctx->image, fp, 1, &row_pointers, &width, &height, &bit_depth, &color_type);
+    fclose(fp);
+    if (rc != CONVERT_OK)
+        return rc;
 
-    //memory cleanup
-    for (int y=0; y<height; y++)
-        free(row_pointers[y]);
-    free(row_pointers);
+    long size_after = size_before;
+    if (color_type != PNG_COLOR_TYPE_RGB) {
+        fprintf(stderr, "%s: has an alpha channel, left as is\n", fn);
+    } else {
+        snprintf(fn_tmp, sizeof(fn_tmp), "%s.opt", fn);
+        FILE* fp_out = fopen(fn_tmp, "wb");
+        if (!fp_out)
+            return convert_fail(CONVERT_ERR_WRITE, "[fopen] %s could not be opened for writing", fn_tmp);
+        long size = optimize_write_png(fp_out, row_pointers, width, height);
+        if (fclose(fp_out) || size < 0) {
+            unlink(fn_tmp);
+            if (convert_cancelled(ctx))
+                return convert_timeout(fn);
+            return convert_fail(CONVERT_ERR_WRITE, "[optimize_write_png] Error writing %s", fn_tmp);
+        }
+        // only a smaller file that reads back as the same image replaces it
+        if (size < size_before && !optimize_same_pixels(ctx, fn_tmp, row_pointers, width, height)) {
+            fprintf(stderr, "%s: optimized output does not match, left as is\n", fn);
+            unlink(fn_tmp);
+        } else if (size < size_before) {
+            if (rename(fn_tmp, fn)) {
+                unlink(fn_tmp);
+                return convert_fail(CONVERT_ERR_WRITE, "[rename] %s", fn_tmp);
+            }
+            size_after = size;
+        } else {
+            unlink(fn_tmp);
+        }
+    }
+    __atomic_add_fetch(&optimize_bytes_before, size_before, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&optimize_bytes_after, size_after, __ATOMIC_RELAXED);
+    return CONVERT_OK;
+}
 
-    return 0;
-}
\ No newline at end of file
+// post-pass over an existing output: re-encodes argc[1] with the optimizer
+// and replaces it only when the result is smaller and decodes to the same
+// samples. No grayscale conversion is done, so files already written by
+// colorConvert keep their pixels; 16 bit files are left alone. Only the
+// image survives the rewrite: ancillary chunks (text, gamma, timestamps
+// and the like) are dropped.
+int optimizeConvert(int argv, char* argc[]){
+    if (argv < 2)
+        return convert_fail(CONVERT_ERR_USAGE, "usage: <executable> <png file>");
+    ConvertContext* ctx = convert_context();
+    convert_watch_begin(ctx);
+    int rc = optimize_convert_file(ctx, argc[1]);
+    convert_watch_end(ctx);
+    return rc;
+}
@@ -14,84 +14,1143 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
-
-//key for shared memory
-#define KEY ftok("hw4", 65)
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/memfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 
 //thread pool
+#define TASK_QUEUE_SIZE 256
+#define TASK_PATH_MAX 512
+
 pthread_mutex_t mutexQueue;
-pthread_cond_t condQueue;
+pthread_cond_t condQueue;       // signalled when a task is queued or the pool stops
+pthread_cond_t condQueueSpace;  // broadcast when a task is taken off a full queue
+pthread_cond_t condLatch;       // broadcast when a latch opens
 
-//
+// one file of a batched task
+typedef struct TaskFile {
+    char src[TASK_PATH_MAX];
+    char dest[TASK_PATH_MAX];
+} TaskFile;
+
+// completion tracking: each folder the pool is given gets a latch, and
+// every file its submitter queues counts against it. A file is done once
+// it converted, failed for good or was dropped by a stop; one waiting for
+// a retry is not. The latch opens when the submitter has sealed it and
+// all its files are done, which is the barrier the pool waits at before
+// it takes the next folder, with the same threads.
+typedef struct PoolLatch {
+    long files;                 // queued so far
+    long done;
+    long failed;
+    int sealed;                 // no more files will be added
+    double started;             // first file queued
+    double finished;            // latch opened
+} PoolLatch;
+
+// a task owns copies of its paths since the submitter reuses its buffers
 typedef struct Task {
-    void (*taskFunction)(int, char*[]);
+    int (*taskFunction)(int, char*[]);
     char* exec;
-    char* src;
-    char* dest;
+    char src[TASK_PATH_MAX];
+    char dest[TASK_PATH_MAX];
+    size_t mem;                 // estimated peak memory, 0 when unknown
+    int skips;                  // times a later task was admitted before it
+    double waitStart;           // when it first found no room, or 0
+    int attempts;               // times it already failed
+    size_t bytes;               // input size, for throughput
+    int node;                   // NUMA node it was dealt to (--numa-split)
+    int klass;                  // TASK_LIVE or TASK_BACKLOG
+    int aged;                   // backlog task moved ahead of everything
+    double stamp;               // image timestamp, newer runs first
+    double queued;              // when it was queued
+    TaskFile* batch;            // when set, the files to convert instead of
+    int batchCount;             // src and dest; freed by the worker
+    PoolLatch* latch;           // folder it belongs to, NULL for live frames
 } Task;
 
-Task taskQueue[256];
+Task taskQueue[TASK_QUEUE_SIZE];
 int taskCount = 0;
+int tasksRunning = 0;
+int workerCount = 0;            // workers taking tasks; the rest are parked
+int poolStopping = 0;           // no more tasks will be submitted
+pthread_t* poolThreads = NULL;  // every worker started, parked or not
+int poolStarted = 0;
+
+// auto sizing (n given as "auto"): the worker count follows the CPUs the
+// cgroup lets us use and, unless --mem-limit is given, the memory budget
+// follows its memory limit less a quarter for everything that is not an
+// image. The pool rereads the limits every AUTO_RESIZE_SECONDS while it
+// is being fed or drained and parks or starts workers to match. Only the
+// pool modes (tp and o) take auto, as only the pool can be resized.
+#define AUTO_RESIZE_SECONDS 1.0
+int autoSize = 0;
+int autoMemory = 0;             // memLimit comes from the cgroup
+double autoChecked = 0;
+
+// adaptive sizing (n given as "adaptive"): the pool starts at the CPU
+// count and a controller thread measures throughput over windows of
+// --adapt-window seconds, moving the number of active workers a step at a
+// time for as long as bytes per second keep improving by ADAPT_GAIN. Once
+// neither direction helps it settles on the best setting seen, and starts
+// climbing again if throughput there drifts by more than ADAPT_DRIFT.
+// Windows in which workers ran out of queued tasks say nothing about n and
+// are ignored. Only the tp and o pools tune themselves; the other modes
+// run at the starting count.
+#define ADAPT_GAIN 0.03
+#define ADAPT_DRIFT 0.2
+int adaptive = 0;
+double adaptWindow = 2.0;
+long poolImagesDone = 0;
+long long poolBytesDone = 0;
+int adaptBest = 0;              // best setting and its throughput
+double adaptBestRate = 0;
+double adaptBestImages = 0;
+
+// memory admission (--mem-limit): a task only starts when its estimated
+// footprint fits in what is left of the budget. Each worker's share of
+// memInFlight is the larger of its current task's estimate and what its
+// ConvertContext holds between images. Later tasks may overtake one that
+// does not fit, but only TASK_MAX_SKIPS times, so big images are not
+// starved. While a task waits, idle workers give back their buffers; one
+// bigger than the whole budget runs once nothing else is running.
+#define TASK_MAX_SKIPS 8
+
+// batching (--batch): the folder's submitter packs up to batchSize files
+// into one task, so the queue's lock and condition variable round trip is
+// paid once per batch rather than once per file. Under --batch=auto (the
+// default) workers set batchSize from the running mean time per file,
+// aiming for TASK_BATCH_SECONDS of work per task; anything bigger than a
+// thumbnail takes longer than that on its own and stays one file a task.
+// Submit and dequeue costs are the time spent holding or waiting for the
+// queue's lock, not waiting for room or for work.
+#define TASK_BATCH_MAX 64
+#define TASK_BATCH_SECONDS 0.002
+int batchAuto = 1;
+int batchSize = 1;
+double fileSeconds = 0;         // mean time per file, decaying
+long tasksSubmitted = 0;
+long filesSubmitted = 0;
+double submitSeconds = 0;
+long tasksTaken = 0;
+double dequeueSeconds = 0;
+
+// priority classes (--live=DIR): files that appear in DIR while the pool
+// works through the folder are live and go ahead of the backlog; within a
+// class the newest image runs first, by the timestamp in PF_image<time>
+// names or else the mtime. When live frames keep the workers from taking
+// a backlog task for agingSeconds (--aging), the backlog task queued
+// longest is aged and goes ahead of everything, so a steady stream of
+// live frames slows the backlog down but cannot starve it. The folder's
+// submitter leaves TASK_LIVE_RESERVE queue entries for live frames so
+// they never wait behind a full queue. Without --live the queue is FIFO.
+#define TASK_LIVE 0
+#define TASK_BACKLOG 1
+#define TASK_LIVE_RESERVE 64
+const char* liveDir = NULL;
+double agingSeconds = 5.0;
+int liveStop = 0;               // the watcher should return
+long classTasks[2];             // queue wait per class, as tasks are taken
+double classWait[2];
+double classMaxWait[2];
+long tasksAged = 0;
+long filesDropped = 0;          // queued when a stop was requested
+
+// overload (--overload, with --live): at most liveQueueMax live frames
+// wait in the queue. Past that, block stalls the watcher as before (the
+// kernel then holds the events, and loses them once its own queue
+// overflows), drop sheds the oldest pending frame, and defer moves it to
+// the deferred list, which workers take from only when the queue is empty;
+// when that is full its oldest frame is shed. As frames pile up, live or
+// deferred, encoding degrades to convert_degrade FAST at degradeAt of them
+// and FASTEST at liveQueueMax, and steps back once they fall below half of
+// the threshold it crossed.
+#define OVERLOAD_BLOCK 0
+#define OVERLOAD_DROP 1
+#define OVERLOAD_DEFER 2
+#define DEFER_QUEUE_SIZE 1024
+int overloadPolicy = OVERLOAD_BLOCK;
+int liveQueueMax = 32;
+int degradeAt = 0;              // 0 for half of liveQueueMax
+int liveQueued = 0;             // live tasks in the queue
+Task deferQueue[DEFER_QUEUE_SIZE];
+int deferCount = 0;
+long framesShed = 0;
+long framesDeferred = 0;
+long framesMissed = 0;          // inotify overflows
+int degradeChanges = 0;
+int backlogQueued = 0;          // backlog tasks in the queue
+double backlogServed = 0;       // last time one was taken
+size_t memLimit = 0;            // 0 for no limit
+size_t memInFlight = 0;
+size_t memPeak = 0;
+long memWaits = 0;              // tasks that had to wait for memory,
+size_t memWaitBytes = 0;        // their estimates,
+double memWaitSeconds = 0;      // and how long they waited in total
+
+// event loops (mode ev): n threads each keep up to --in-flight files open
+// at once and decode them with libpng's progressive reader, reading
+// EVENT_READ_SIZE bytes of one file, handing them to its decoder and
+// moving on to the next, so a file that is slow to deliver its data holds
+// up only its own decode. Descriptors epoll can watch (pipes, sockets)
+// are only read once it says they have data; regular files are always
+// readable to epoll, which refuses them, so they are read in turn and the
+// loop only sleeps in epoll_wait when nothing else is ready. Rows are
+// turned gray, and mostly encoded, as they are decoded (see
+// convert_progressive_stream), on the loop's thread. The loops share the
+// directory stream and open the next file whenever a slot frees up.
+#define EVENT_READ_SIZE (64 * 1024)
+#define EVENT_IN_FLIGHT_MAX 256
+#define EVENT_WAIT_MS 100       // so a loop asleep in epoll sees a stop
+int eventInFlight = 16;
+pthread_mutex_t eventLock = PTHREAD_MUTEX_INITIALIZER;
+DIR* eventDirectory;
+const char* eventFolder;
+
+// ingest (--ingest=SOURCE, mode ev): PNG images sent back to back down a
+// stream are converted as their bytes arrive, into out_stream<S>_<F>.png
+// in the folder, so an output is written about as soon as its input has
+// been sent. SOURCE is "-" for standard input, a FIFO, or the path of a
+// Unix socket to create and listen on, where each connection is a stream
+// of its own. Streams take loop slots ahead of the folder's files. A
+// stream ends at end of file; a socket is listened on until SIGINT or
+// SIGTERM. Frames are not journaled, as they cannot be read again.
+const char* ingestSource = NULL;
+int ingestFd = -1;              // standard input or FIFO, until a loop takes it
+int ingestListen = -1;          // the listening socket
+int ingestStreams = 0;          // streams numbered so far
+
+// failed conversions: each file given up on gets a tab separated line of
+// path, error and message in --failure-log. Under --retry=N one that
+// failed for a transient reason (convert_error_transient) is instead put
+// on a retry queue, which workers only take from once the main queue is
+// empty. Lines go out in a single write to an O_APPEND descriptor, so
+// worker processes can share the log.
+int failureLog = -1;
+int retryLimit = 0;             // retries per file
+long filesFailed = 0;
+long filesRetried = 0;
+Task retryQueue[TASK_QUEUE_SIZE];
+int retryCount = 0;
+
+void logFailure(const char* src, const char* error, const char* message) {
+    char line[2 * TASK_PATH_MAX];
+    if (failureLog < 0)
+        return;
+    int len = snprintf(line, sizeof(line), "%s\t%s\t%s\n", src, error, message);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (write(failureLog, line, len) != len)
+        perror("failure log");
+}
+
+// quarantine (--quarantine=FILE): images over the size limits, cancelled
+// by the watchdog or crashing their worker are appended to FILE as a path
+// and a reason, and the files already listed there are skipped, so a bad
+// image costs its time once rather than on every run
+int quarantineFd = -1;
+char** quarantined = NULL;      // paths listed when the run started, sorted
+int quarantinedCount = 0;
+long quarantineSkipped = 0;
+
+int comparePaths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int loadQuarantine(const char* path) {
+    FILE* fp = fopen(path, "r");
+    char line[2 * TASK_PATH_MAX];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\t\n")] = '\0';
+        quarantined = realloc(quarantined, (quarantinedCount + 1) * sizeof(*quarantined));
+        quarantined[quarantinedCount++] = strdup(line);
+    }
+    if (fp)
+        fclose(fp);
+    qsort(quarantined, quarantinedCount, sizeof(*quarantined), comparePaths);
+    quarantineFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    return quarantineFd < 0 ? -1 : 0;
+}
+
+int isQuarantined(const char* src) {
+    if (quarantinedCount == 0 ||
+        !bsearch(&src, quarantined, quarantinedCount, sizeof(*quarantined), comparePaths))
+        return 0;
+    __atomic_add_fetch(&quarantineSkipped, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void quarantineFile(const char* src, const char* reason) {
+    char line[2 * TASK_PATH_MAX];
+    if (quarantineFd < 0)
+        return;
+    int len = snprintf(line, sizeof(line), "%s\t%s\n", src, reason);
+    if (len < (int)sizeof(line) && write(quarantineFd, line, len) != len)
+        perror("quarantine");
+}
+
+// logs a conversion that failed with rc and message, and quarantines it
+// when the image itself is the problem
+void reportFailure(const char* src, int rc, const char* message) {
+    logFailure(src, convert_error_name(rc), message);
+    if (rc == CONVERT_ERR_LIMIT || rc == CONVERT_ERR_TIMEOUT)
+        quarantineFile(src, convert_error_name(rc));
+}
+
+// a convert_parallel call spread over the pool: indices [next, count) are
+// still unclaimed. Idle workers pick these up before starting new tasks.
+typedef struct ParallelJob {
+    void (*fn)(void*, int);
+    void* arg;
+    int count;
+    int next;
+    int finished;
+    struct ParallelJob* link;
+} ParallelJob;
+
+ParallelJob* parallelJobs = NULL;   // jobs with unclaimed indices, oldest first
+pthread_cond_t condParallelDone;    // signalled when a job's last index finishes
 
 sem_t semaphore;
 
-int thread_solution(DIR* directory, int n, char* folderName);
+int thread_solution(DIR* directory, int n, const char* folderName);
+int static_solution(DIR* directory, int n, const char* folderName);
+int event_solution(DIR* directory, int n, const char* folderName);
 void thread_method(char* args[]);
-void process_solution(DIR* directory, int n, char* folderName, int numThreads);
+void process_solution(DIR* directory, int n, const char* folderName, int numThreads);
+extern int splitDecoders;
+extern int processThreads;
 void submitTask(Task task);
-void executeTask(Task* task);
-int threadpool_solution(DIR* directory, int n, char* folderName);
+int executeTask(Task* task, int file);
+int threadpool_solution(DIR** directories, char** folderNames, int folders, int n, int postPass);
+void autoResize(void);
+
+// monotonic wall clock in seconds; clock() only counts this process's cpu
+// time, which says nothing useful once several threads are converting
+double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// task journal (--journal=FILE): a start line when a file's conversion
+// begins and a done line with its result when it ends, appended to FILE.
+// Lines are buffered, then written and fdatasync'ed together every
+// JOURNAL_GROUP lines or JOURNAL_SYNC_SECONDS, so a crash loses at most
+// the last group, and the files in it are only converted again. With
+// --resume the files the journal has a done line for are skipped, unless
+// that line is a transient failure. Worker processes keep their own
+// buffers and flush them before they exit.
+#define JOURNAL_GROUP 64
+#define JOURNAL_SYNC_SECONDS 1.0
+int journalFd = -1;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+char journalBuf[JOURNAL_GROUP * (TASK_PATH_MAX + 32)];
+size_t journalLen = 0;
+int journalLines = 0;
+double journalSynced = 0;
+char** finished = NULL;         // files done in earlier runs, sorted
+int finishedCount = 0;
+long resumeSkipped = 0;
+
+// SIGINT and SIGTERM stop dispatching: queued tasks are dropped, the
+// running ones finish (and are journaled) and the run ends as usual. The
+// handler is one-shot, so a second signal kills the process.
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int sig) {
+    stopRequested = 1;
+}
+
+// writes and syncs the buffered lines. Called with journalLock held.
+void journalFlush(void) {
+    size_t done = 0;
+    while (done < journalLen) {
+        ssize_t len = write(journalFd, journalBuf + done, journalLen - done);
+        if (len < 0 && errno != EINTR) {
+            perror("journal");
+            break;
+        }
+        if (len > 0)
+            done += len;
+    }
+    if (journalLen && fdatasync(journalFd))
+        perror("journal");
+    journalLen = 0;
+    journalLines = 0;
+    journalSynced = wall_seconds();
+}
+
+void journalRecord(const char* kind, const char* src, const char* result) {
+    if (journalFd < 0)
+        return;
+    pthread_mutex_lock(&journalLock);
+    if (journalLen + TASK_PATH_MAX + 32 > sizeof(journalBuf))
+        journalFlush();
+    int len = snprintf(journalBuf + journalLen, sizeof(journalBuf) - journalLen, "%s\t%s%s%s\n", kind, src,
+                       result ? "\t" : "", result ? result : "");
+    if (len > 0 && journalLen + len < sizeof(journalBuf))
+        journalLen += len;
+    if (++journalLines >= JOURNAL_GROUP || wall_seconds() - journalSynced >= JOURNAL_SYNC_SECONDS)
+        journalFlush();
+    pthread_mutex_unlock(&journalLock);
+}
+
+void journalStart(const char* src) {
+    journalRecord("start", src, NULL);
+}
+
+void journalDone(const char* src, int rc) {
+    journalRecord("done", src, convert_error_name(rc));
+}
+
+// writes out what is still buffered
+void journalSync(void) {
+    if (journalFd < 0)
+        return;
+    pthread_mutex_lock(&journalLock);
+    journalFlush();
+    pthread_mutex_unlock(&journalLock);
+}
+
+// opens the journal for appending and, when resuming, reads the files it
+// already has a result for
+int openJournal(const char* path, int resume) {
+    FILE* fp = resume ? fopen(path, "r") : NULL;
+    char line[2 * TASK_PATH_MAX];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* src = line + 5;
+        char* result = strchr(src, '\t');
+        if (strncmp(line, "done\t", 5) || !result)
+            continue;
+        *result++ = '\0';
+        int transient = 0;
+        for (int code = 0; code <= CONVERT_ERR_TIMEOUT; code++)
+            if (!strcmp(result, convert_error_name(code)))
+                transient = convert_error_transient(code);
+        if (transient)
+            continue;
+        finished = realloc(finished, (finishedCount + 1) * sizeof(*finished));
+        finished[finishedCount++] = strdup(src);
+    }
+    if (fp)
+        fclose(fp);
+    qsort(finished, finishedCount, sizeof(*finished), comparePaths);
+    journalFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    journalSynced = wall_seconds();
+    return journalFd < 0 ? -1 : 0;
+}
+
+// files not to dispatch: quarantined, or finished in a run being resumed
+int skipFile(const char* src) {
+    if (isQuarantined(src))
+        return 1;
+    if (finishedCount == 0 || !bsearch(&src, finished, finishedCount, sizeof(*finished), comparePaths))
+        return 0;
+    __atomic_add_fetch(&resumeSkipped, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// counts dTLB load misses of this process and every thread it starts
+// from now on; -1 when perf events are not available (no PMU, or
+// perf_event_paranoid forbids it)
+int openTlbCounter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// reads the first line of file in this process's cgroup: under the v2
+// unified hierarchy, or else under controller's v1 hierarchy (or its root,
+// when the container's cgroup namespace makes that ours). 0 on success.
+int readCgroup(const char* controller, const char* file, char* buf, int size) {
+    char line[1024], path[2048];
+    FILE* fp = fopen("/proc/self/cgroup", "r");
+    if (!fp)
+        return -1;
+    int found = -1;
+    while (found < 0 && fgets(line, sizeof(line), fp)) {
+        // id:controllers:path
+        char* controllers = strchr(line, ':');
+        char* dir = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!dir)
+            continue;
+        *dir++ = '\0';
+        controllers++;
+        dir[strcspn(dir, "\n")] = '\0';
+        FILE* f = NULL;
+        if (*controllers == '\0') {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/%s", dir, file);
+            f = fopen(path, "r");
+        } else {
+            // controllers is a comma separated list
+            char* c;
+            for (c = strtok(controllers, ","); c && strcmp(c, controller); c = strtok(NULL, ","))
+                ;
+            if (!c)
+                continue;
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/%s%s/%s", controller, dir, file);
+            if (!(f = fopen(path, "r"))) {
+                snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/%s", controller, file);
+                f = fopen(path, "r");
+            }
+        }
+        if (f) {
+            if (fgets(buf, size, f))
+                found = 0;
+            fclose(f);
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// number of CPUs in a list like "0-3,8,10-11"
+int countCpuList(const char* list) {
+    int count = 0;
+    while (*list && *list != '\n') {
+        char* end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        count += last - first + 1;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// workers the cgroup's CPU limits allow: the effective cpuset, further
+// capped by the cpu quota rounded up, so a quota of 2.5 CPUs gets 3.
+// *memory is set to the memory limit, or 0 when there is none.
+int autoWorkers(size_t* memory) {
+    char buf[4096];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (readCgroup("cpuset", "cpuset.cpus.effective", buf, sizeof(buf)) == 0 ||
+        readCgroup("cpuset", "cpuset.effective_cpus", buf, sizeof(buf)) == 0) {
+        int count = countCpuList(buf);
+        if (count > 0 && count < cpus)
+            cpus = count;
+    }
+    long quota = -1, period = 0;
+    if (readCgroup("cpu", "cpu.max", buf, sizeof(buf)) == 0) {
+        if (strncmp(buf, "max", 3) != 0)
+            sscanf(buf, "%ld %ld", &quota, &period);
+    } else if (readCgroup("cpu", "cpu.cfs_quota_us", buf, sizeof(buf)) == 0) {
+        quota = atol(buf);
+        if (readCgroup("cpu", "cpu.cfs_period_us", buf, sizeof(buf)) == 0)
+            period = atol(buf);
+    }
+    if (quota > 0 && period > 0 && (quota + period - 1) / period < cpus)
+        cpus = (quota + period - 1) / period;
+
+    *memory = 0;
+    if (readCgroup("memory", "memory.max", buf, sizeof(buf)) == 0 ||
+        readCgroup("memory", "memory.limit_in_bytes", buf, sizeof(buf)) == 0) {
+        // v1 reports no limit as a huge page-rounded number
+        unsigned long long limit = strtoull(buf, NULL, 10);
+        if (strncmp(buf, "max", 3) != 0 && limit > 0 && limit < (1ULL << 60))
+            *memory = limit;
+    }
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// CPU placement (--affinity): compact fills the CPUs of one NUMA node
+// before moving to the next, scatter deals workers out to the nodes in
+// turn. Only the CPUs this process may run on are used, and a machine
+// without /sys/devices/system/node counts as one node. A pinned worker
+// creates its ConvertContext on its own CPU, so first touch already puts
+// its buffers on the local node; --numa-bind makes that an explicit
+// policy. --numa-split deals the input files out to the nodes in turn;
+// workers take their own node's files first and the others' only when
+// theirs run out.
+#define AFFINITY_NONE 0
+#define AFFINITY_COMPACT 1
+#define AFFINITY_SCATTER 2
+#define MAX_CPUS 1024
+int affinity = AFFINITY_NONE;
+int numaSplit = 0;
+int cpuCount = 0;               // CPUs we may use, grouped by node
+int cpuList[MAX_CPUS];
+int nodeCount = 0;              // nodes with CPUs we may use
+int nodeId[MAX_CPUS];
+int nodeFirst[MAX_CPUS];        // their CPUs in cpuList
+int nodeSize[MAX_CPUS];
+int dealtTasks = 0;             // tasks dealt out under --numa-split
+
+// 1 when cpu is in a list like "0-3,8,10-11"
+int cpuListHas(const char* list, int cpu) {
+    while (*list && *list != '\n') {
+        char* end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (cpu >= first && cpu <= last)
+            return 1;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+// reads the CPUs we may run on and the nodes they belong to
+void loadTopology(void) {
+    unsigned long mask[MAX_CPUS / (8 * sizeof(unsigned long))];
+    int bits = 8 * sizeof(unsigned long);
+    char path[128], buf[4096];
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0)
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < MAX_CPUS; cpu++)
+            mask[cpu / bits] |= 1UL << (cpu % bits);
+    cpuCount = nodeCount = 0;
+    for (int node = 0; node < MAX_CPUS; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        nodeFirst[nodeCount] = cpuCount;
+        if (fgets(buf, sizeof(buf), fp))
+            for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+                if ((mask[cpu / bits] >> (cpu % bits) & 1) && cpuListHas(buf, cpu))
+                    cpuList[cpuCount++] = cpu;
+        fclose(fp);
+        nodeSize[nodeCount] = cpuCount - nodeFirst[nodeCount];
+        if (nodeSize[nodeCount])
+            nodeId[nodeCount++] = node;
+    }
+    if (cpuCount == 0) {
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+            if (mask[cpu / bits] >> (cpu % bits) & 1)
+                cpuList[cpuCount++] = cpu;
+        nodeCount = 1;
+        nodeId[0] = nodeFirst[0] = 0;
+        nodeSize[0] = cpuCount;
+    }
+}
+
+// index into cpuList of worker i's CPU, or -1 when workers are not pinned
+int workerCpu(int i) {
+    if (affinity == AFFINITY_NONE || cpuCount == 0)
+        return -1;
+    if (affinity == AFFINITY_COMPACT)
+        return i % cpuCount;
+    int node = i % nodeCount;
+    return nodeFirst[node] + i / nodeCount % nodeSize[node];
+}
+
+// node (an index into nodeId) worker i runs on, or -1 when not pinned
+int workerNode(int i) {
+    int cpu = workerCpu(i);
+    int node = 0;
+    if (cpu < 0)
+        return -1;
+    while (node + 1 < nodeCount && cpu >= nodeFirst[node + 1])
+        node++;
+    return node;
+}
+
+// pins the calling thread to worker i's CPU
+void pinWorker(int i) {
+    unsigned long mask[MAX_CPUS / (8 * sizeof(unsigned long))];
+    int bits = 8 * sizeof(unsigned long);
+    int cpu = workerCpu(i);
+    if (cpu < 0)
+        return;
+    memset(mask, 0, sizeof(mask));
+    mask[cpuList[cpu] / bits] |= 1UL << (cpuList[cpu] % bits);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+        perror("sched_setaffinity");
+}
+
+// pages allocated system wide since boot on the node of the CPU asking for
+// them (local) and on other nodes (remote), from each node's numastat
+void readNumastat(long long* local, long long* remote) {
+    char path[128], name[64];
+    long long value;
+    *local = *remote = 0;
+    for (int node = 0; node < MAX_CPUS; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/numastat", node);
+        FILE* fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        while (fscanf(fp, "%63s %lld", name, &value) == 2) {
+            if (strcmp(name, "local_node") == 0)
+                *local += value;
+            else if (strcmp(name, "other_node") == 0)
+                *remote += value;
+        }
+        fclose(fp);
+    }
+}
+
+// parses a byte count with an optional k, m or g suffix
+int parseSize(const char* text, unsigned long* size) {
+    char* end;
+    errno = 0;
+    *size = strtoul(text, &end, 10);
+    if (end == text || errno)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        *size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        *size <<= 20, end++;
+    else if (*end == 'g' || *end == 'G')
+        *size <<= 30, end++;
+    return *end ? -1 : 0;
+}
 
 int main(int argc, char *argv[])
 {
     //clocks for tracking speed
-    clock_t start;
-    clock_t end;
+    double start = 0;
+    double end = 0;
+    int pageStats = 0;          // report page faults and dTLB misses
+
+    static struct option long_options[] = {
+        {"codec", required_argument, NULL, 'c'},
+        {"optimize", no_argument, NULL, 'O'},
+        {"restart-rows", required_argument, NULL, 'r'},
+        {"zbuf-size", required_argument, NULL, 'z'},
+        {"no-arena", no_argument, NULL, 'A'},
+        {"mem-limit", required_argument, NULL, 'm'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"prefault", no_argument, NULL, 'P'},
+        {"mlock", no_argument, NULL, 'L'},
+        {"page-stats", no_argument, NULL, 'S'},
+        {"split", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'T'},
+        {"failure-log", required_argument, NULL, 'F'},
+        {"retry", required_argument, NULL, 'R'},
+        {"max-dimension", required_argument, NULL, 'D'},
+        {"max-pixels", required_argument, NULL, 'X'},
+        {"max-chunk", required_argument, NULL, 'K'},
+        {"max-chunks", required_argument, NULL, 'N'},
+        {"cpu-limit", required_argument, NULL, 'W'},
+        {"quarantine", required_argument, NULL, 'Q'},
+        {"adapt-window", required_argument, NULL, 'w'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"numa-bind", no_argument, NULL, 'b'},
+        {"numa-split", no_argument, NULL, 'M'},
+        {"live", required_argument, NULL, 'l'},
+        {"aging", required_argument, NULL, 'g'},
+        {"batch", required_argument, NULL, 'k'},
+        {"journal", required_argument, NULL, 'J'},
+        {"overload", required_argument, NULL, 'o'},
+        {"live-queue", required_argument, NULL, 'q'},
+        {"degrade-at", required_argument, NULL, 'd'},
+        {"resume", no_argument, NULL, 'U'},
+        {"in-flight", required_argument, NULL, 'I'},
+        {"ingest", required_argument, NULL, 'i'},
+        {0, 0, 0, 0}
+    };
+    const char* journal = NULL;
+    int resume = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            if (strcmp(optarg, "native") == 0)
+                convert_codec = CONVERT_CODEC_NATIVE;
+            else if (strcmp(optarg, "libpng") == 0)
+                convert_codec = CONVERT_CODEC_LIBPNG;
+            else {
+                fprintf(stderr, "Usage: --codec must be native or libpng\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'O':
+            convert_optimize = 1;
+            break;
+        case 'r':
+            convert_restart_rows = strtoul(optarg, NULL, 10);
+            break;
+        case 'z': {
+            // bytes, with an optional k or m suffix; 0 sizes per image
+            unsigned long size;
+            if (parseSize(optarg, &size) || (size && (size < 1024 || size > PNG_UINT_31_MAX))) {
+                fprintf(stderr, "Usage: --zbuf-size must be 0 or between 1k and 2047m\n");
+                return EXIT_FAILURE;
+            }
+            convert_zbuf_size = size;
+            break;
+        }
+        case 'A':
+            convert_arena = 0;
+            break;
+        case 'm': {
+            unsigned long size;
+            if (parseSize(optarg, &size)) {
+                fprintf(stderr, "Usage: --mem-limit takes bytes with an optional k, m or g suffix\n");
+                return EXIT_FAILURE;
+            }
+            memLimit = size;
+            break;
+        }
+        case 'H':
+            if (strcmp(optarg, "off") == 0)
+                convert_pages = CONVERT_PAGES_NORMAL;
+            else if (strcmp(optarg, "thp") == 0)
+                convert_pages = CONVERT_PAGES_THP;
+            else if (strcmp(optarg, "hugetlb") == 0)
+                convert_pages = CONVERT_PAGES_HUGETLB;
+            else {
+                fprintf(stderr, "Usage: --hugepages must be off, thp or hugetlb\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            convert_prefault = 1;
+            break;
+        case 'L':
+            convert_mlock = 1;
+            break;
+        case 'S':
+            pageStats = 1;
+            break;
+        case 's':
+            splitDecoders = atoi(optarg);
+            break;
+        case 'T':
+            processThreads = atoi(optarg);
+            break;
+        case 'F':
+            failureLog = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (failureLog < 0) {
+                perror(optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            retryLimit = atoi(optarg);
+            break;
+        case 'D':
+            convert_max_width = convert_max_height = strtoul(optarg, NULL, 10);
+            break;
+        case 'X':
+            convert_max_pixels = strtoull(optarg, NULL, 10);
+            break;
+        case 'K': {
+            unsigned long size;
+            if (parseSize(optarg, &size)) {
+                fprintf(stderr, "Usage: --max-chunk takes bytes with an optional k, m or g suffix\n");
+                return EXIT_FAILURE;
+            }
+            convert_max_chunk = size;
+            break;
+        }
+        case 'N':
+            convert_max_chunks = strtoul(optarg, NULL, 10);
+            break;
+        case 'W':
+            convert_cpu_limit = atof(optarg);
+            break;
+        case 'w':
+            adaptWindow = atof(optarg);
+            break;
+        case 'a':
+            if (strcmp(optarg, "none") == 0)
+                affinity = AFFINITY_NONE;
+            else if (strcmp(optarg, "compact") == 0)
+                affinity = AFFINITY_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                affinity = AFFINITY_SCATTER;
+            else {
+                fprintf(stderr, "Usage: --affinity must be none, compact or scatter\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            convert_numa_bind = 1;
+            break;
+        case 'M':
+            numaSplit = 1;
+            break;
+        case 'l':
+            liveDir = optarg;
+            break;
+        case 'g':
+            agingSeconds = atof(optarg);
+            break;
+        case 'J':
+            journal = optarg;
+            break;
+        case 'o':
+            if (strcmp(optarg, "block") == 0)
+                overloadPolicy = OVERLOAD_BLOCK;
+            else if (strcmp(optarg, "drop") == 0)
+                overloadPolicy = OVERLOAD_DROP;
+            else if (strcmp(optarg, "defer") == 0)
+                overloadPolicy = OVERLOAD_DEFER;
+            else {
+                fprintf(stderr, "Usage: --overload must be block, drop or defer\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            // live frames never wait for room behind the backlog
+            liveQueueMax = atoi(optarg);
+            if (liveQueueMax < 2 || liveQueueMax > TASK_LIVE_RESERVE) {
+                fprintf(stderr, "Usage: --live-queue must be between 2 and %d\n", TASK_LIVE_RESERVE);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            degradeAt = atoi(optarg);
+            break;
+        case 'U':
+            resume = 1;
+            break;
+        case 'i':
+            ingestSource = optarg;
+            break;
+        case 'I':
+            eventInFlight = atoi(optarg);
+            if (eventInFlight < 1 || eventInFlight > EVENT_IN_FLIGHT_MAX) {
+                fprintf(stderr, "Usage: --in-flight must be between 1 and %d\n", EVENT_IN_FLIGHT_MAX);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            if (strcmp(optarg, "auto") == 0) {
+                batchAuto = 1;
+            } else {
+                batchAuto = 0;
+                batchSize = atoi(optarg);
+                if (batchSize < 1 || batchSize > TASK_BATCH_MAX) {
+                    fprintf(stderr, "Usage: --batch must be auto or between 1 and %d\n", TASK_BATCH_MAX);
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+        case 'Q':
+            if (loadQuarantine(optarg)) {
+                perror(optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
 
     // check for right number of arguments
-    if (argc != 4)
+    if (argc - optind < 3)
     {
-        perror("Usage: ./driver <n:int> <s:char> <folder:char>");
+        perror("Usage: ./driver <n:int|auto|adaptive> (auto with tp and o only) <s:char> <folder:char> [folder...] [--codec=native|libpng] [--optimize] [--restart-rows=N] [--zbuf-size=N[k|m]] [--no-arena] [--mem-limit=N[k|m|g]] [--hugepages=off|thp|hugetlb] [--prefault] [--mlock] [--page-stats] [--split=D] [--threads=T] [--failure-log=FILE] [--retry=N] [--max-dimension=N] [--max-pixels=N] [--max-chunk=N[k|m]] [--max-chunks=N] [--cpu-limit=SECONDS] [--quarantine=FILE] [--adapt-window=SECONDS] [--affinity=none|compact|scatter] [--numa-bind] [--numa-split] [--live=DIR] [--aging=SECONDS] [--batch=auto|K] [--journal=FILE] [--resume] [--overload=block|drop|defer] [--live-queue=N] [--degrade-at=N] [--in-flight=K] [--ingest=-|FIFO|SOCKET]");
         return EXIT_FAILURE;
     }
 
+    if (resume && !journal) {
+        fprintf(stderr, "Usage: --resume needs --journal\n");
+        return EXIT_FAILURE;
+    }
+    if (journal && openJournal(journal, resume)) {
+        perror(journal);
+        return EXIT_FAILURE;
+    }
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = requestStop;
+    stop.sa_flags = SA_RESTART | SA_RESETHAND;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
     //convert cli vars to local
-    int n = atoi(argv[1]);
+    int n = atoi(argv[optind]);
+    if (strcmp(argv[optind], "adaptive") == 0) {
+        // starts where auto sizing would and tunes from there
+        size_t memory;
+        adaptive = 1;
+        n = autoWorkers(&memory);
+        printf("Adaptive: starting at n=%d\n", n);
+    } else if (strcmp(argv[optind], "auto") == 0) {
+        size_t memory;
+        if (strcmp(argv[optind + 1], "tp") != 0 && strcmp(argv[optind + 1], "o") != 0) {
+            fprintf(stderr, "Usage: auto only works with tp and o, whose pool can follow the cgroup; give n\n");
+            return EXIT_FAILURE;
+        }
+        autoSize = 1;
+        n = autoWorkers(&memory);
+        if (memLimit == 0 && memory) {
+            autoMemory = 1;
+            memLimit = memory - memory / 4;
+        }
+        printf("Auto: %d workers, memory budget %s\n", n, memLimit ? "from the cgroup" : "unlimited");
+    }
 
     if (n < 0) 
         perror("Usage: <n:int> must have a greater that 0 value");
-    char *selector = argv[2];
-    const char *folderName = argv[3];
+    char *selector = argv[optind + 1];
+    const char *folderName = argv[optind + 2];
 
 
     //initialize semaphore with number of threads
     sem_init(&semaphore, 0, n);
 
+    // the pool modes run several folders back to back on the same threads
+    int folders = argc - optind - 2;
+    if (folders > 1 && strcmp(selector, "tp") != 0 && strcmp(selector, "o") != 0) {
+        fprintf(stderr, "Usage: only tp and o take more than one folder\n");
+        return EXIT_FAILURE;
+    }
+    if (memLimit && strcmp(selector, "ev") == 0) {
+        fprintf(stderr, "Usage: ev has no memory admission; --mem-limit needs another mode\n");
+        return EXIT_FAILURE;
+    }
+    char** folderNames = &argv[optind + 2];
+    DIR** directories = malloc(folders * sizeof(*directories));
+
     //open user defined directory
-    DIR *directory = opendir(folderName);
+    for (int b = 0; b < folders; b++) {
+        directories[b] = opendir(folderNames[b]);
+        if (directories[b] == NULL)
+        {
+            perror("Failed to open directory");
+            return EXIT_FAILURE;
+        }
+    }
+    DIR *directory = directories[0];
 
-    if (directory == NULL)
-    {
-        perror("Failed to open directory");
-        return EXIT_FAILURE;
+    // opened before any worker starts so they all inherit the counter
+    int tlbCounter = pageStats ? openTlbCounter() : -1;
+    struct rusage usageBefore;
+    long long numaLocal, numaRemote;
+    getrusage(RUSAGE_SELF, &usageBefore);
+    readNumastat(&numaLocal, &numaRemote);
+
+    // splitting by node needs workers placed on every node
+    if (numaSplit && affinity == AFFINITY_NONE)
+        affinity = AFFINITY_SCATTER;
+    if (affinity != AFFINITY_NONE) {
+        loadTopology();
+        printf("Affinity: %d CPUs on %d nodes, %s\n", cpuCount, nodeCount,
+               affinity == AFFINITY_COMPACT ? "compact" : "scatter");
     }
 
     //flow control for selecting between light weight and heavy processes
     if (strcmp(selector, "t") == 0) {
         thread_solution(directory, n, folderName);
+    } else if (strcmp(selector, "tp") == 0) {
+        start = wall_seconds();
+        threadpool_solution(directories, folderNames, folders, n, 0);
+        end = wall_seconds();
+    } else if (strcmp(selector, "o") == 0) {
+        start = wall_seconds();
+        threadpool_solution(directories, folderNames, folders, n, 1);
+        end = wall_seconds();
+        printf("Optimized: %lld -> %lld bytes\n", optimize_bytes_before, optimize_bytes_after);
+    } else if (strcmp(selector, "lpt") == 0) {
+        start = wall_seconds();
+        static_solution(directory, n, folderName);
+        end = wall_seconds();
+    } else if (strcmp(selector, "ev") == 0) {
+        start = wall_seconds();
+        event_solution(directory, n, folderName);
+        end = wall_seconds();
     } else if (strcmp(selector, "p") == 0) {
-        start = clock();
-        process_solution(directory, n, folderName, n);
-        end = clock();           
+        start = wall_seconds();
+        process_solution(directory, n, folderName, 1);
+        end = wall_seconds();
+    } else if (strcmp(selector, "pt") == 0) {
+        start = wall_seconds();
+        // adaptive sizing counted threads; split them into processes
+        if (adaptive)
+            n = n / processThreads > 0 ? n / processThreads : 1;
+        process_solution(directory, n, folderName, processThreads);
+        end = wall_seconds();
     } else {
-        perror("Usage: <s:char> must be p or t");
+        perror("Usage: <s:char> must be p, pt, t, tp, o, lpt or ev (o shrinks existing out_ files losslessly and drops "
+               "their ancillary chunks)");
+    }
+    if (convert_optimize && strcmp(selector, "o") != 0)
+        printf("Optimized output: %lld bytes\n", optimize_bytes_after);
+    if (memLimit)
+        printf("Memory: peak %.1f MB of %.1f MB budget; %ld tasks waited for %.1f MB, %.3fs in total\n",
+               memPeak / 1048576.0, memLimit / 1048576.0, memWaits,
+               memWaitBytes / 1048576.0, memWaitSeconds);
+    if (pageStats) {
+        struct rusage usage;
+        long long tlbMisses = -1;
+        getrusage(RUSAGE_SELF, &usage);
+        if (tlbCounter >= 0 && read(tlbCounter, &tlbMisses, sizeof(tlbMisses)) != sizeof(tlbMisses))
+            tlbMisses = -1;
+        printf("Page faults: %ld minor, %ld major; ", usage.ru_minflt - usageBefore.ru_minflt,
+               usage.ru_majflt - usageBefore.ru_majflt);
+        if (tlbMisses >= 0)
+            printf("dTLB load misses: %lld\n", tlbMisses);
+        else
+            printf("dTLB load misses: unavailable\n");
+        long long local, remote;
+        readNumastat(&local, &remote);
+        printf("NUMA: %lld local, %lld remote page allocations system wide\n", local - numaLocal,
+               remote - numaRemote);
+        if (convert_numa_failures)
+            printf("NUMA: %ld buffers could not be bound to their node\n", convert_numa_failures);
+        if (convert_hugetlb_fallbacks || convert_mlock_failures)
+            printf("Huge pages: %ld hugetlb allocations fell back to THP, %ld mlock failures\n",
+                   convert_hugetlb_fallbacks, convert_mlock_failures);
     }
-    
-    closedir(directory);
+    if (filesFailed || filesRetried)
+        printf("Failed: %ld files, after %ld retries\n", filesFailed, filesRetried);
+    if (tasksSubmitted)
+        printf("Scheduling: %ld files in %ld tasks (batch size %d), %.2f us to submit and %.2f us to take a "
+               "task\n",
+               filesSubmitted, tasksSubmitted, batchSize, 1e6 * submitSeconds / tasksSubmitted,
+               tasksTaken ? 1e6 * dequeueSeconds / tasksTaken : 0);
+    if (liveDir)
+        printf("Queue wait: live %ld tasks, %.3fs mean, %.3fs max; backlog %ld tasks, %.3fs mean, %.3fs max, "
+               "%ld aged\n",
+               classTasks[TASK_LIVE], classTasks[TASK_LIVE] ? classWait[TASK_LIVE] / classTasks[TASK_LIVE] : 0,
+               classMaxWait[TASK_LIVE], classTasks[TASK_BACKLOG],
+               classTasks[TASK_BACKLOG] ? classWait[TASK_BACKLOG] / classTasks[TASK_BACKLOG] : 0,
+               classMaxWait[TASK_BACKLOG], tasksAged);
+    if (liveDir && (framesShed || framesDeferred || framesMissed || degradeChanges))
+        printf("Overload: %ld live frames shed, %ld deferred, %ld missed by inotify; degradation level %d after %d "
+               "changes\n",
+               framesShed, framesDeferred, framesMissed, convert_degrade, degradeChanges);
+    if (adaptive && adaptBest)
+        printf("Adaptive: best n=%d (%.1f images/s, %.1f MB/s); pass it as n to reuse it\n", adaptBest,
+               adaptBestImages, adaptBestRate / 1e6);
+    if (quarantineSkipped)
+        printf("Quarantine: skipped %ld listed files\n", quarantineSkipped);
+    if (resumeSkipped)
+        printf("Resume: skipped %ld files finished in earlier runs\n", resumeSkipped);
+    // a listening ingest socket is only ever stopped by a signal
+    if (stopRequested && (filesDropped || ingestListen < 0))
+        printf("Stopped by a signal: %ld queued files dropped; rerun with --resume to finish\n", filesDropped);
+    journalSync();
+    convert_watch_shutdown();
+    if (convert_png_allocs)
+        printf("libpng allocations: %lld, %lld from the heap\n", convert_png_allocs, convert_png_heap_allocs);
+
+    for (int b = 0; b < folders; b++)
+        closedir(directories[b]);
+    free(directories);
 
     //calculate and print time elapsed 
-    double time_elapsed = (((double) end - (double) start)/ CLOCKS_PER_SEC);
+    double time_elapsed = end - start;
     printf("Total time: %fs\n", time_elapsed);
     return EXIT_SUCCESS;
 } 
@@ -99,7 +1158,7 @@ int main(int argc, char *argv[])
 // thread solution takes in a directory containing png images, the max number of
 // threads, the name of the folder containing the images. It then creates up to  
 // n light weight thread to execute the colorConver function.
-int thread_solution(DIR* directory, int n, char* folderName) {
+int thread_solution(DIR* directory, int n, const char* folderName) {
     // struct to hold file data
     struct dirent *directory_ent;
 
@@ -110,7 +1169,7 @@ int thread_solution(DIR* directory, int n, char* folderName) {
     int counter = 0;
 
     // while there are files left to read
-    while ((directory_ent = readdir(directory)) != NULL)
+    while (!stopRequested && (directory_ent = readdir(directory)) != NULL)
     {    
         //if parent dir or current dir skip
         if (!strcmp(directory_ent->d_name, ".") || !strcmp(directory_ent->d_name, ".."))
@@ -153,93 +1212,1326 @@ int thread_solution(DIR* directory, int n, char* folderName) {
     pthread_exit(0);
 }
 
+// removes one index from a parallel job and runs it. Called and returns
+// with mutexQueue held.
+void runParallelStep(ParallelJob* job) {
+    int i = job->next++;
+    if (job->next == job->count) {
+        ParallelJob** p = &parallelJobs;
+        while (*p != job)
+            p = &(*p)->link;
+        *p = job->link;
+    }
+    pthread_mutex_unlock(&mutexQueue);
+    job->fn(job->arg, i);
+    pthread_mutex_lock(&mutexQueue);
+    if (++job->finished == job->count)
+        pthread_cond_broadcast(&condParallelDone);
+}
+
+// convert_parallel for the pool: the caller works through its own indices
+// while idle workers help, then waits for the ones they took
+void pool_parallel(int count, void (*fn)(void*, int), void* arg) {
+    ParallelJob job = { .fn = fn, .arg = arg, .count = count };
+    if (count == 0)
+        return;
+    pthread_mutex_lock(&mutexQueue);
+    ParallelJob** p = &parallelJobs;
+    while (*p)
+        p = &(*p)->link;
+    *p = &job;
+    pthread_cond_broadcast(&condQueue);
+    while (job.next < job.count)
+        runParallelStep(&job);
+    while (job.finished < job.count)
+        pthread_cond_wait(&condParallelDone, &mutexQueue);
+    pthread_mutex_unlock(&mutexQueue);
+}
+
+// 1 when a runs before b under --live
+int taskBefore(const Task* a, const Task* b) {
+    if (a->aged != b->aged)
+        return a->aged;
+    if (a->klass != b->klass)
+        return a->klass < b->klass;
+    return a->stamp > b->stamp;
+}
+
+// puts a task in its place in the queue, behind the ones it ties with.
+// Called with mutexQueue held and room in the queue.
+void queueInsert(Task task) {
+    int i = taskCount++;
+    while (liveDir && i > 0 && taskBefore(&task, &taskQueue[i - 1])) {
+        taskQueue[i] = taskQueue[i - 1];
+        i--;
+    }
+    taskQueue[i] = task;
+}
+
+// ages the backlog task queued longest once none has been taken for
+// agingSeconds. Called with mutexQueue held.
+void ageTasks(void) {
+    int oldest = -1;
+    if (backlogQueued == 0 || wall_seconds() - backlogServed < agingSeconds)
+        return;
+    for (int i = 0; i < taskCount; i++) {
+        if (taskQueue[i].aged)
+            return;
+        if (taskQueue[i].klass == TASK_BACKLOG && (oldest < 0 || taskQueue[i].queued < taskQueue[oldest].queued))
+            oldest = i;
+    }
+    if (oldest < 0)
+        return;
+    Task t = taskQueue[oldest];
+    for (int j = oldest; j < taskCount - 1; j++)
+        taskQueue[j] = taskQueue[j + 1];
+    taskCount--;
+    t.aged = 1;
+    tasksAged++;
+    queueInsert(t);
+}
+
+// moves the degradation level with the number of frames waiting. Called
+// with mutexQueue held.
+void updateDegrade(void) {
+    static const char* names[] = {"full compression", "fast compression", "fastest compression"};
+    int pending = liveQueued + deferCount;
+    int at = degradeAt ? degradeAt : liveQueueMax / 2;
+    int level = convert_degrade;
+    if (pending >= liveQueueMax)
+        level = CONVERT_DEGRADE_FASTEST;
+    else if (pending >= at && level < CONVERT_DEGRADE_FAST)
+        level = CONVERT_DEGRADE_FAST;
+    else if (level == CONVERT_DEGRADE_FASTEST && pending < liveQueueMax / 2)
+        level = CONVERT_DEGRADE_FAST;
+    if (level == CONVERT_DEGRADE_FAST && pending < at / 2)
+        level = CONVERT_DEGRADE_NONE;
+    if (level == convert_degrade)
+        return;
+    __atomic_store_n(&convert_degrade, level, __ATOMIC_RELAXED);
+    degradeChanges++;
+    printf("Overload: %d frames waiting, degradation level %d (%s)\n", pending, level, names[level]);
+}
+
+// makes room for one more live frame by shedding or deferring the oldest
+// pending one; its path is copied to shed when it was dropped. Called
+// with mutexQueue held.
+void shedLiveFrame(char* shed) {
+    int oldest = -1;
+    shed[0] = '\0';
+    for (int i = 0; i < taskCount; i++)
+        if (taskQueue[i].klass == TASK_LIVE && !taskQueue[i].batch &&
+            (oldest < 0 || taskQueue[i].stamp < taskQueue[oldest].stamp))
+            oldest = i;
+    if (oldest < 0)
+        return;
+    Task t = taskQueue[oldest];
+    for (int j = oldest; j < taskCount - 1; j++)
+        taskQueue[j] = taskQueue[j + 1];
+    taskCount--;
+    liveQueued--;
+    if (overloadPolicy == OVERLOAD_DEFER) {
+        if (deferCount == DEFER_QUEUE_SIZE) {
+            memcpy(shed, deferQueue[0].src, TASK_PATH_MAX);
+            memmove(deferQueue, deferQueue + 1, (DEFER_QUEUE_SIZE - 1) * sizeof(Task));
+            deferCount--;
+            framesShed++;
+        }
+        t.klass = TASK_BACKLOG;
+        deferQueue[deferCount++] = t;
+        framesDeferred++;
+    } else {
+        memcpy(shed, t.src, TASK_PATH_MAX);
+        framesShed++;
+    }
+}
+
+// counts files of a latch as done, failed ones included. Called with
+// mutexQueue held.
+void latchDone(PoolLatch* latch, long done, long failed) {
+    if (!latch)
+        return;
+    latch->done += done;
+    latch->failed += failed;
+    if (latch->sealed && latch->done == latch->files) {
+        latch->finished = wall_seconds();
+        pthread_cond_broadcast(&condLatch);
+    }
+}
+
+// no more files will be added to the latch
+void latchSeal(PoolLatch* latch) {
+    pthread_mutex_lock(&mutexQueue);
+    latch->sealed = 1;
+    latchDone(latch, 0, 0);
+    pthread_mutex_unlock(&mutexQueue);
+}
+
+// waits for a sealed latch to open, or for a stop
+void latchWait(PoolLatch* latch) {
+    pthread_mutex_lock(&mutexQueue);
+    while (latch->done < latch->files && !stopRequested) {
+        // the signal handler cannot wake us, so look again now and then
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&condLatch, &mutexQueue, &until);
+        // auto sizing keeps following the cgroup while the folder drains
+        pthread_mutex_unlock(&mutexQueue);
+        autoResize();
+        pthread_mutex_lock(&mutexQueue);
+    }
+    pthread_mutex_unlock(&mutexQueue);
+}
+
+// index of the first queued task that fits in the memory budget for a
+// worker currently holding reserved bytes, or -1; under --numa-split the
+// first one dealt to the worker's node, if any fits. Called with
+// mutexQueue held.
+int nextAdmissibleTask(size_t reserved, int node) {
+    if (stopRequested && (taskCount > 0 || retryCount > 0 || deferCount > 0)) {
+        for (int i = 0; i < taskCount; i++) {
+            int files = taskQueue[i].batch ? taskQueue[i].batchCount : 1;
+            filesDropped += files;
+            latchDone(taskQueue[i].latch, files, 0);
+            free(taskQueue[i].batch);
+        }
+        for (int i = 0; i < retryCount; i++)
+            latchDone(retryQueue[i].latch, 1, 0);
+        for (int i = 0; i < deferCount; i++)
+            latchDone(deferQueue[i].latch, 1, 0);
+        filesDropped += retryCount + deferCount;
+        taskCount = retryCount = backlogQueued = liveQueued = deferCount = 0;
+        pthread_cond_broadcast(&condQueueSpace);
+        return -1;
+    }
+    // retries wait until there is nothing new to do
+    if (taskCount == 0 && retryCount > 0) {
+        taskQueue[taskCount++] = retryQueue[0];
+        taskQueue[0].queued = wall_seconds();
+        if (taskQueue[0].klass == TASK_BACKLOG)
+            backlogQueued++;
+        else
+            liveQueued++;
+        for (int i = 1; i < retryCount; i++)
+            retryQueue[i - 1] = retryQueue[i];
+        retryCount--;
+    }
+    // then deferred live frames, oldest first
+    if (taskCount == 0 && deferCount > 0) {
+        Task t = deferQueue[0];
+        memmove(deferQueue, deferQueue + 1, (deferCount - 1) * sizeof(Task));
+        deferCount--;
+        t.queued = wall_seconds();
+        backlogQueued++;
+        queueInsert(t);
+        updateDegrade();
+    }
+    if (liveDir)
+        ageTasks();
+    for (int local = numaSplit && node >= 0; local >= 0; local--) {
+        for (int i = 0; i < taskCount; i++) {
+            Task* t = &taskQueue[i];
+            if (local && t->node != node)
+                continue;
+            size_t need = t->mem > reserved ? t->mem : reserved;
+            if (memLimit == 0 || memInFlight - reserved + need <= memLimit || tasksRunning == 0) {
+                // the ones it overtakes count a skip
+                for (int j = 0; j < i; j++)
+                    if (!local || taskQueue[j].node == node)
+                        taskQueue[j].skips++;
+                return i;
+            }
+            if (t->waitStart == 0)
+                t->waitStart = wall_seconds();
+            if (t->skips >= TASK_MAX_SKIPS)
+                return -1;
+        }
+    }
+    return -1;
+}
+
+// worker loop: helps with parallel jobs first, then runs queued tasks, until
+// the queue is empty, nothing is running and the pool is stopping. Each
+// worker keeps its ConvertContext (zlib streams and codec buffers) for its
+// whole life, so they are reused by every image it converts.
 void* startThread(void* args) {
+    int self = (int)(intptr_t)args;
+    int node = workerNode(self);
+    size_t reserved = 0;        // this worker's share of memInFlight
+    int released = 0;           // buffers already given back while idle
+    pinWorker(self);
     while (1) {
         Task task;
+        int next = -1;
 
+        double lockStart = wall_seconds();
         pthread_mutex_lock(&mutexQueue);
-        while (taskCount == 0) {
+        while (1) {
+            // workers beyond workerCount are parked until the pool grows
+            int parked = self >= workerCount;
+            if (!parked && (parallelJobs != NULL || (next = nextAdmissibleTask(reserved, node)) >= 0))
+                break;
+            if (poolStopping && tasksRunning == 0 && taskCount == 0)
+                break;
+            if (((taskCount > 0 && memLimit) || parked) && !released) {
+                // a task is waiting for room this idle worker is holding,
+                // or the worker is parked and should hold nothing
+                pthread_mutex_unlock(&mutexQueue);
+                ConvertContext* ctx = convert_context();
+                convert_context_trim(ctx, 0);
+                size_t held = convert_context_held(ctx);
+                pthread_mutex_lock(&mutexQueue);
+                memInFlight = memInFlight - reserved + held;
+                reserved = held;
+                released = 1;
+                pthread_cond_broadcast(&condQueue);
+                lockStart = wall_seconds();
+                continue;
+            }
             pthread_cond_wait(&condQueue, &mutexQueue);
+            lockStart = wall_seconds();
+        }
+        if (parallelJobs != NULL) {
+            runParallelStep(parallelJobs);
+            pthread_mutex_unlock(&mutexQueue);
+            continue;
+        }
+        if (next < 0) {
+            pthread_mutex_unlock(&mutexQueue);
+            break;
         }
 
-        task = taskQueue[0];
+        task = taskQueue[next];
         int i;
-        for (i = 0; i < taskCount - 1; i++) {
+        for (i = next; i < taskCount - 1; i++) {
             taskQueue[i] = taskQueue[i + 1];
         }
         taskCount--;
+        double waited = wall_seconds() - task.queued;
+        classTasks[task.klass]++;
+        classWait[task.klass] += waited;
+        if (waited > classMaxWait[task.klass])
+            classMaxWait[task.klass] = waited;
+        if (task.klass == TASK_BACKLOG) {
+            backlogQueued--;
+            backlogServed = wall_seconds();
+        } else {
+            liveQueued--;
+        }
+        if (liveDir)
+            updateDegrade();
+        tasksRunning++;
+        released = 0;
+        if (task.mem > reserved) {
+            memInFlight += task.mem - reserved;
+            reserved = task.mem;
+        }
+        if (memInFlight > memPeak)
+            memPeak = memInFlight;
+        if (task.waitStart != 0) {
+            memWaits++;
+            memWaitBytes += task.mem;
+            memWaitSeconds += wall_seconds() - task.waitStart;
+        }
+        tasksTaken++;
+        dequeueSeconds += wall_seconds() - lockStart;
         pthread_mutex_unlock(&mutexQueue);
-        executeTask(&task);
+        pthread_cond_broadcast(&condQueueSpace);
+
+        // failures keep their message until the lock decides on retries
+        int files = task.batch ? task.batchCount : 1;
+        int rcs[TASK_BATCH_MAX];
+        char errors[TASK_BATCH_MAX][sizeof(convert_context()->error)];
+        double runStart = wall_seconds();
+        for (int f = 0; f < files; f++) {
+            journalStart(task.batch ? task.batch[f].src : task.src);
+            rcs[f] = executeTask(&task, f);
+            journalDone(task.batch ? task.batch[f].src : task.src, rcs[f]);
+            if (rcs[f] != CONVERT_OK)
+                snprintf(errors[f], sizeof(errors[f]), "%s", convert_context()->error);
+        }
+        double perFile = (wall_seconds() - runStart) / files;
+
+        // under a budget, give back pooled buffers beyond this worker's
+        // even share and keep only what is still held reserved
+        size_t held = reserved;
+        if (memLimit) {
+            ConvertContext* ctx = convert_context();
+            convert_context_trim(ctx, memLimit / workerCount);
+            held = convert_context_held(ctx);
+        }
+
+        pthread_mutex_lock(&mutexQueue);
+        tasksRunning--;
+        memInFlight = memInFlight - reserved + held;
+        reserved = held;
+        int retry = 0, retried = 0, failed = 0;
+        for (int f = 0; f < files; f++) {
+            if (rcs[f] == CONVERT_OK)
+                continue;
+            if (task.attempts < retryLimit && convert_error_transient(rcs[f]) && retryCount < TASK_QUEUE_SIZE) {
+                // a batch's failures are retried one file a task
+                Task again = task;
+                if (task.batch) {
+                    memcpy(again.src, task.batch[f].src, sizeof(again.src));
+                    memcpy(again.dest, task.batch[f].dest, sizeof(again.dest));
+                    again.batch = NULL;
+                    again.batchCount = 0;
+                }
+                again.attempts++;
+                again.skips = 0;
+                again.waitStart = 0;
+                retryQueue[retryCount++] = again;
+                filesRetried++;
+                rcs[f] = CONVERT_OK;
+                retry = 1;
+                retried++;
+            } else {
+                filesFailed++;
+                failed++;
+            }
+        }
+        latchDone(task.latch, files - retried, failed);
+        poolImagesDone += files;
+        poolBytesDone += task.bytes;
+        fileSeconds = fileSeconds ? 0.9 * fileSeconds + 0.1 * perFile : perFile;
+        if (batchAuto) {
+            int size = fileSeconds > 0 ? (int)(TASK_BATCH_SECONDS / fileSeconds) : TASK_BATCH_MAX;
+            __atomic_store_n(&batchSize, size < 1 ? 1 : size > TASK_BATCH_MAX ? TASK_BATCH_MAX : size,
+                             __ATOMIC_RELAXED);
+        }
+        // freed memory, a retry or the last task may let waiting workers go
+        if (memLimit || retry || (poolStopping && tasksRunning == 0 && taskCount == 0))
+            pthread_cond_broadcast(&condQueue);
+        pthread_mutex_unlock(&mutexQueue);
+        for (int f = 0; f < files; f++)
+            if (rcs[f] != CONVERT_OK)
+                reportFailure(task.batch ? task.batch[f].src : task.src, rcs[f], errors[f]);
+        free(task.batch);
     }
+    // the worker's context goes away with the thread
+    pthread_mutex_lock(&mutexQueue);
+    memInFlight -= reserved;
+    pthread_mutex_unlock(&mutexQueue);
+    return NULL;
 }
 
+// image timestamp of a PF_image<date> <time> file, or else its mtime
+double taskStamp(const char* path, const char* name) {
+    struct tm tm;
+    double seconds;
+    struct stat st;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(name, "PF_image%d-%d-%d %d:%d:%lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
+               &tm.tm_min, &seconds) == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        return (double)mktime(&tm) + seconds;
+    }
+    if (stat(path, &st) == 0)
+        return st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+    return 0;
+}
+
+// queues a task, blocking while the queue is full
 void submitTask(Task task) {
+    int room = liveDir && task.klass == TASK_BACKLOG ? TASK_QUEUE_SIZE - TASK_LIVE_RESERVE : TASK_QUEUE_SIZE;
+    char shed[TASK_PATH_MAX] = "";
+    double lockStart = wall_seconds();
     pthread_mutex_lock(&mutexQueue);
-    taskQueue[taskCount] = task;
-    taskCount++;
+    if (task.klass == TASK_LIVE && overloadPolicy != OVERLOAD_BLOCK && liveQueued >= liveQueueMax)
+        shedLiveFrame(shed);
+    while (taskCount >= room) {
+        pthread_cond_wait(&condQueueSpace, &mutexQueue);
+        lockStart = wall_seconds();
+    }
+    if (numaSplit)
+        task.node = workerNode(dealtTasks++ % workerCount);
+    task.queued = wall_seconds();
+    if (task.klass == TASK_BACKLOG && backlogQueued++ == 0)
+        backlogServed = task.queued;
+    if (task.klass == TASK_LIVE)
+        liveQueued++;
+    queueInsert(task);
+    if (liveDir)
+        updateDegrade();
+    if (task.latch) {
+        if (task.latch->files == 0)
+            task.latch->started = task.queued;
+        task.latch->files += task.batch ? task.batchCount : 1;
+    }
+    tasksSubmitted++;
+    filesSubmitted += task.batch ? task.batchCount : 1;
+    submitSeconds += wall_seconds() - lockStart;
     pthread_mutex_unlock(&mutexQueue);
     pthread_cond_signal(&condQueue);
+    if (shed[0])
+        logFailure(shed, "shed", "live frame dropped under overload");
 }
 
-void executeTask(Task* task) {
-    char* args[] = {task->exec, task->src, task->dest}; 
-    task->taskFunction(3, args);
+// submits the batch being packed, as a plain task when it holds one file
+void submitBatch(Task* pending) {
+    if (pending->batchCount == 1) {
+        memcpy(pending->src, pending->batch[0].src, sizeof(pending->src));
+        memcpy(pending->dest, pending->batch[0].dest, sizeof(pending->dest));
+        free(pending->batch);
+        pending->batch = NULL;
+        pending->batchCount = 0;
+    }
+    if (pending->batch || pending->src[0])
+        submitTask(*pending);
+    memset(pending, 0, sizeof(*pending));
 }
 
-int threadpool_solution(DIR* directory, int n, char* folderName) {
+// converts the task's file'th file
+int executeTask(Task* task, int file) {
+    char* args[] = {task->exec, task->batch ? task->batch[file].src : task->src,
+                    task->batch ? task->batch[file].dest : task->dest};
+    return task->taskFunction(3, args);
+}
 
-    pthread_t th[n];
-    pthread_mutex_init(&mutexQueue, NULL);
-    pthread_cond_init(&condQueue, NULL);
-    int i;
-    for (i = 0; i < n; i++) {
-        if (pthread_create(&th[i], NULL, &startThread, NULL) != 0) {
-            perror("Failed to create the thread");
+// sets the number of workers taking tasks, starting threads when there
+// are not enough; extra ones park. Called with mutexQueue held.
+void poolResize(int n) {
+    // the thread list belongs to poolStop once it has begun
+    if (poolStopping)
+        return;
+    if (n > poolStarted) {
+        poolThreads = realloc(poolThreads, n * sizeof(*poolThreads));
+        for (; poolStarted < n; poolStarted++) {
+            if (pthread_create(&poolThreads[poolStarted], NULL, &startThread,
+                               (void*)(intptr_t)poolStarted) != 0) {
+                perror("Failed to create the thread");
+                break;
+            }
         }
+        n = poolStarted;
+    }
+    workerCount = n;
+    pthread_cond_broadcast(&condQueue);
+}
+
+// rereads the cgroup limits under auto sizing, at most every
+// AUTO_RESIZE_SECONDS, and resizes the pool and budget when they changed
+void autoResize(void) {
+    if (!autoSize || wall_seconds() - autoChecked < AUTO_RESIZE_SECONDS)
+        return;
+    autoChecked = wall_seconds();
+    size_t memory;
+    int n = autoWorkers(&memory);
+    pthread_mutex_lock(&mutexQueue);
+    if (n != workerCount) {
+        printf("Auto: cgroup limits changed, %d workers\n", n);
+        poolResize(n);
+    }
+    if (autoMemory && memory && memory - memory / 4 != memLimit) {
+        memLimit = memory - memory / 4;
+        pthread_cond_broadcast(&condQueue);
     }
-    printf("pthreads created");
+    pthread_mutex_unlock(&mutexQueue);
+}
+
+// the adaptive sizing controller; returns once the pool has drained
+void* adaptiveController(void* args) {
+    pthread_mutex_lock(&mutexQueue);
+    int cores = workerCount;
+    pthread_mutex_unlock(&mutexQueue);
+    int maxWorkers = 4 * cores;
+    int step = cores / 4 > 0 ? cores / 4 : 1;
+    int direction = 1, reversed = 0, settled = 0;
+    double settledRate = 0;
+
+    while (1) {
+        // one window at the current setting
+        pthread_mutex_lock(&mutexQueue);
+        long images = poolImagesDone;
+        long long bytes = poolBytesDone;
+        int n = workerCount;
+        int starved = 0, done = 0;
+        pthread_mutex_unlock(&mutexQueue);
+        double start = wall_seconds();
+        while (!done && wall_seconds() - start < adaptWindow) {
+            usleep(20000);
+            pthread_mutex_lock(&mutexQueue);
+            starved |= taskCount == 0 && tasksRunning < workerCount;
+            done = poolStopping && tasksRunning == 0 && taskCount == 0 && retryCount == 0 && deferCount == 0;
+            pthread_mutex_unlock(&mutexQueue);
+        }
+        if (done)
+            break;
+        pthread_mutex_lock(&mutexQueue);
+        double seconds = wall_seconds() - start;
+        double rate = (poolBytesDone - bytes) / seconds;
+        double imageRate = (poolImagesDone - images) / seconds;
+        pthread_mutex_unlock(&mutexQueue);
+        if (starved)
+            continue;
+
+        int next = n;
+        if (settled) {
+            if (fabs(rate - settledRate) <= ADAPT_DRIFT * settledRate)
+                continue;
+            printf("Adaptive: throughput moved from %.1f to %.1f MB/s, tuning again\n", settledRate / 1e6,
+                   rate / 1e6);
+            settled = reversed = 0;
+            direction = 1;
+            adaptBest = 0;
+        }
+        printf("Adaptive: n=%d gave %.1f images/s, %.1f MB/s\n", n, imageRate, rate / 1e6);
+        if (adaptBest == 0 || rate > adaptBestRate * (1 + ADAPT_GAIN)) {
+            adaptBest = n;
+            adaptBestRate = rate;
+            adaptBestImages = imageRate;
+            next = n + direction * step;
+        }
+        // no better than the best so far: try the other side of it once
+        if (next == n || next < 1 || next > maxWorkers) {
+            next = adaptBest - direction * step;
+            direction = -direction;
+            if (reversed++ || next < 1 || next > maxWorkers) {
+                settled = 1;
+                settledRate = adaptBestRate;
+                next = adaptBest;
+                printf("Adaptive: settled on n=%d (%.1f images/s, %.1f MB/s)\n", adaptBest, adaptBestImages,
+                       adaptBestRate / 1e6);
+            }
+        }
+        if (next != n && !settled)
+            printf("Adaptive: trying n=%d\n", next);
+        if (next != n) {
+            pthread_mutex_lock(&mutexQueue);
+            poolResize(next);
+            pthread_mutex_unlock(&mutexQueue);
+        }
+    }
+    return NULL;
+}
+
+// queues a live task for a file that appeared in liveDir
+void submitLive(const char* name) {
+    size_t len = strlen(name);
+    if (len < 4 || strcmp(name + len - 4, ".png") || !strncmp(name, "out_", 4))
+        return;
+    Task t = {
+        .taskFunction = &colorConvert,
+        .exec = "./colorConvert",
+        .klass = TASK_LIVE,
+    };
+    snprintf(t.src, sizeof(t.src), "%s/%s", liveDir, name);
+    snprintf(t.dest, sizeof(t.dest), "%s/out_%s", liveDir, name);
+    if (stopRequested || skipFile(t.src))
+        return;
+    t.stamp = taskStamp(t.src, name);
+    if (adaptive) {
+        struct stat st;
+        if (stat(t.src, &st) == 0)
+            t.bytes = st.st_size;
+    }
+    if (memLimit)
+        t.mem = convert_estimate_memory(t.src);
+    submitTask(t);
+}
+
+// watches liveDir with inotify until liveStop is set, queueing the files
+// already there and every file then written or moved into it
+void* liveWatcher(void* args) {
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buf;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, liveDir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(liveDir);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    DIR* dir = opendir(liveDir);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL)
+        submitLive(entry->d_name);
+    if (dir)
+        closedir(dir);
+
+    while (1) {
+        pthread_mutex_lock(&mutexQueue);
+        int stop = liveStop || stopRequested;
+        pthread_mutex_unlock(&mutexQueue);
+        if (stop)
+            break;
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 50) > 0) {
+            ssize_t len = read(fd, &buf, sizeof(buf));
+            for (char* e = buf.bytes; len > 0 && e < buf.bytes + len;) {
+                struct inotify_event* event = (struct inotify_event*)e;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    fprintf(stderr, "%s: inotify queue overflowed, live frames were missed\n", liveDir);
+                    framesMissed++;
+                }
+                if (event->len)
+                    submitLive(event->name);
+                e += sizeof(*event) + event->len;
+            }
+        }
+        autoResize();
+    }
+    close(fd);
+    return NULL;
+}
+
+// queues the files of one folder for the pool, counting them against latch
+void submitFolder(DIR* directory, const char* folderName, int postPass, PoolLatch* latch) {
     // struct to hold file data
     struct dirent *directory_ent;
-    while ((directory_ent = readdir(directory)) != NULL)
+    Task pending;               // batch being packed
+    memset(&pending, 0, sizeof(pending));
+    while (!stopRequested && (directory_ent = readdir(directory)) != NULL)
     {
         //if parent dir or current dir skip
         if (!strcmp(directory_ent->d_name, ".") || !strcmp(directory_ent->d_name, ".."))
            continue;
-
-        char dest[50], src[50];
-
-        //create arguments for args struct 
-        char* fileName = directory_ent->d_name;
-
-        //input file name creation
-        strcpy(src, "images/");
-        strcat(src , fileName);
-
-        //output file name creation same as source with out_ preaprended 
-        strcpy(dest, "images/");
-        strcat(dest, "out_");
-        strcat(dest, fileName);
+        //outputs land in the same folder, don't convert them again; the
+        //post pass only looks at them
+        if ((strncmp(directory_ent->d_name, "out_", 4) == 0) != postPass)
+           continue;
 
         Task t = {
-            .taskFunction = &colorConvert,
+            .taskFunction = postPass ? &optimizeConvert : &colorConvert,
             .exec = "./colorConvert",
-            .src = src,
-            .dest = dest
+            .klass = TASK_BACKLOG,
+            .latch = latch,
         };
-        printf("taskAdded %s", t.src);
-        submitTask(t);
+
+        //input file name and output name same as source with out_ preaprended
+        snprintf(t.src, sizeof(t.src), "%s/%s", folderName, directory_ent->d_name);
+        snprintf(t.dest, sizeof(t.dest), "%s/out_%s", folderName, directory_ent->d_name);
+        if (skipFile(t.src))
+            continue;
+        if (adaptive) {
+            struct stat st;
+            if (stat(t.src, &st) == 0)
+                t.bytes = st.st_size;
+        }
+        if (memLimit)
+            t.mem = convert_estimate_memory(t.src);
+        if (liveDir)
+            t.stamp = taskStamp(t.src, directory_ent->d_name);
+        int size = __atomic_load_n(&batchSize, __ATOMIC_RELAXED);
+        TaskFile* batch = NULL;
+        if (size > 1 && pending.batchCount == 0)
+            batch = malloc(TASK_BATCH_MAX * sizeof(TaskFile));
+        if (pending.batchCount == 0 && !batch) {
+            // unbatched, or no memory to pack a batch in
+            submitTask(t);
+        } else {
+            // pack into the pending batch, which needs memory for its
+            // biggest image only since it runs one file at a time
+            if (pending.batchCount == 0) {
+                pending = t;
+                pending.src[0] = pending.dest[0] = '\0';
+                pending.batch = batch;
+            }
+            TaskFile* file = &pending.batch[pending.batchCount++];
+            memcpy(file->src, t.src, sizeof(file->src));
+            memcpy(file->dest, t.dest, sizeof(file->dest));
+            if (pending.batchCount > 1) {
+                pending.bytes += t.bytes;
+                if (t.mem > pending.mem)
+                    pending.mem = t.mem;
+                if (t.stamp > pending.stamp)
+                    pending.stamp = t.stamp;
+            }
+            if (pending.batchCount >= size || pending.batchCount == TASK_BATCH_MAX)
+                submitBatch(&pending);
+        }
+        autoResize();
 
     }
-    for (i = 0; i < n; i++) {
-        if (pthread_join(th[i], NULL) != 0) {
+    if (stopRequested)
+        free(pending.batch);
+    else
+        submitBatch(&pending);
+}
+
+// drain and stop: the workers finish what is queued and exit once the
+// queue is empty and nothing is running, and are joined. The thread list
+// is taken under the lock that also stops poolResize from growing it, so
+// the adaptive controller, which is joined after this, cannot change it.
+void poolStop(void) {
+    pthread_mutex_lock(&mutexQueue);
+    poolStopping = 1;
+    pthread_t* threads = poolThreads;
+    int started = poolStarted;
+    poolThreads = NULL;
+    poolStarted = 0;
+    pthread_mutex_unlock(&mutexQueue);
+    pthread_cond_broadcast(&condQueue);
+
+    for (int i = 0; i < started; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
             perror("Failed to join the thread");
+        }
     }
+    free(threads);
+    convert_watch_shutdown();
+}
+
+// thread pool solution: n long-lived workers take conversion tasks off a
+// shared queue. With postPass set the pool instead runs the optimizer over
+// the out_ files already in the folders.
+//
+// The folders run through one pool a folder at a time: each is queued,
+// sealed and waited for at its latch before the next one starts, and its
+// latency from first file queued to last file done is reported
+int threadpool_solution(DIR** directories, char** folderNames, int folders, int n, int postPass) {
+
+    pthread_mutex_init(&mutexQueue, NULL);
+    pthread_cond_init(&condQueue, NULL);
+    pthread_cond_init(&condQueueSpace, NULL);
+    pthread_cond_init(&condParallelDone, NULL);
+    pthread_cond_init(&condLatch, NULL);
+    poolStopping = 0;
+    convert_parallel = pool_parallel;
+    autoChecked = wall_seconds();
+    pthread_mutex_lock(&mutexQueue);
+    poolResize(n);
+    pthread_mutex_unlock(&mutexQueue);
+    pthread_t controller, watcher;
+    if (adaptive && pthread_create(&controller, NULL, adaptiveController, NULL) != 0) {
+        perror("Failed to create the thread");
+        adaptive = 0;
+    }
+    int watching = liveDir && !postPass;
+    liveStop = 0;
+    if (watching && pthread_create(&watcher, NULL, liveWatcher, NULL) != 0) {
+        perror("Failed to create the thread");
+        watching = 0;
+    }
+
+    // running tasks point at their latch until the pool has stopped
+    PoolLatch* latches = calloc(folders, sizeof(*latches));
+    for (int b = 0; b < folders && !stopRequested; b++) {
+        submitFolder(directories[b], folderNames[b], postPass, &latches[b]);
+        latchSeal(&latches[b]);
+        latchWait(&latches[b]);
+        if (!stopRequested)
+            printf("Batch %d: %s: %ld files, %ld failed, %.3fs from first queued to last done\n", b + 1,
+                   folderNames[b], latches[b].files, latches[b].failed,
+                   latches[b].files ? latches[b].finished - latches[b].started : 0);
+    }
+
+    // the live folder is watched until the backlog has drained
+    if (watching) {
+        pthread_mutex_lock(&mutexQueue);
+        while (taskCount > 0 || tasksRunning > 0 || retryCount > 0 || deferCount > 0) {
+            pthread_mutex_unlock(&mutexQueue);
+            usleep(50000);
+            pthread_mutex_lock(&mutexQueue);
+        }
+        liveStop = 1;
+        pthread_mutex_unlock(&mutexQueue);
+        pthread_join(watcher, NULL);
+    }
+
+    poolStop();
+    if (adaptive)
+        pthread_join(controller, NULL);
+    free(latches);
+    convert_parallel = convert_parallel_serial;
     pthread_mutex_destroy(&mutexQueue);
     pthread_cond_destroy(&condQueue);
+    pthread_cond_destroy(&condQueueSpace);
+    pthread_cond_destroy(&condParallelDone);
+    pthread_cond_destroy(&condLatch);
     return 0;
-        
+}
+
+// static solution (lpt): the folder is scanned once and each file costed
+// by its pixel count from the IHDR, or its size when it has no readable
+// header. Files are dealt out longest first, each to the thread with the
+// least work so far (LPT), and every thread then converts its own list
+// without touching shared state: no queue, no lock, and so no memory
+// budget. Transient failures are retried in place. The report compares
+// each thread's predicted time, its cost at the run's average seconds per
+// unit of cost, with the time it actually took.
+typedef struct StaticFile {
+    char src[TASK_PATH_MAX];
+    char dest[TASK_PATH_MAX];
+    double cost;
+    int thread;
+} StaticFile;
+
+typedef struct StaticThread {
+    int index;
+    StaticFile** files;         // its list, longest first
+    int count;
+    double cost;                // of all its files
+    double seconds;             // time it took
+    long failed;
+    long retried;
+} StaticThread;
+
+// longest first
+int compareCost(const void* a, const void* b) {
+    double ca = ((const StaticFile*)a)->cost, cb = ((const StaticFile*)b)->cost;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+double staticCost(const char* path) {
+    ConvertImage image;
+    size_t size;
+    struct stat st;
+    if (convert_peek_header(path, &image, &size) == 0)
+        return (double)image.width * image.height;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+void* staticThread(void* args) {
+    StaticThread* t = args;
+    pinWorker(t->index);
+    double start = wall_seconds();
+    for (int i = 0; i < t->count && !stopRequested; i++) {
+        char* argv[] = {"./colorConvert", t->files[i]->src, t->files[i]->dest};
+        int rc, attempts = 0;
+        journalStart(argv[1]);
+        while ((rc = colorConvert(3, argv)) != CONVERT_OK && convert_error_transient(rc) &&
+               attempts < retryLimit) {
+            journalDone(argv[1], rc);
+            attempts++;
+            t->retried++;
+        }
+        journalDone(argv[1], rc);
+        if (rc != CONVERT_OK) {
+            t->failed++;
+            reportFailure(t->files[i]->src, rc, convert_context()->error);
+        }
+    }
+    t->seconds = wall_seconds() - start;
+    return NULL;
+}
+
+int static_solution(DIR* directory, int n, const char* folderName) {
+    StaticFile* files = NULL;
+    int count = 0, cap = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || !strncmp(entry->d_name, "out_", 4))
+            continue;
+        if (count == cap) {
+            cap = cap ? 2 * cap : 256;
+            files = realloc(files, cap * sizeof(*files));
+        }
+        StaticFile* f = &files[count];
+        snprintf(f->src, sizeof(f->src), "%s/%s", folderName, entry->d_name);
+        snprintf(f->dest, sizeof(f->dest), "%s/out_%s", folderName, entry->d_name);
+        if (skipFile(f->src))
+            continue;
+        f->cost = staticCost(f->src);
+        count++;
+    }
+    if (n < 1)
+        n = 1;
+
+    // LPT: longest first, each to the least loaded thread
+    qsort(files, count, sizeof(*files), compareCost);
+    StaticThread* threads = calloc(n, sizeof(*threads));
+    pthread_t* ids = malloc(n * sizeof(*ids));
+    for (int i = 0; i < count; i++) {
+        int least = 0;
+        for (int t = 1; t < n; t++)
+            if (threads[t].cost < threads[least].cost)
+                least = t;
+        files[i].thread = least;
+        threads[least].cost += files[i].cost;
+        threads[least].count++;
+    }
+    for (int t = 0; t < n; t++) {
+        threads[t].index = t;
+        threads[t].files = malloc((threads[t].count + 1) * sizeof(StaticFile*));
+        threads[t].count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        StaticThread* t = &threads[files[i].thread];
+        t->files[t->count++] = &files[i];
+    }
+
+    int started = 0;
+    for (; started < n; started++) {
+        if (pthread_create(&ids[started], NULL, staticThread, &threads[started]) != 0) {
+            perror("Failed to create the thread");
+            break;
+        }
+    }
+    // lists of threads that could not start are run here
+    for (int t = started; t < n; t++)
+        staticThread(&threads[t]);
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+
+    double cost = 0, seconds = 0, predictedSpan = 0, actualSpan = 0;
+    for (int t = 0; t < n; t++) {
+        cost += threads[t].cost;
+        seconds += threads[t].seconds;
+    }
+    double rate = cost > 0 ? seconds / cost : 0;
+    for (int t = 0; t < n; t++) {
+        double predicted = threads[t].cost * rate;
+        printf("LPT: thread %d: %d files, predicted %.3fs, actual %.3fs\n", t, threads[t].count, predicted,
+               threads[t].seconds);
+        if (predicted > predictedSpan)
+            predictedSpan = predicted;
+        if (threads[t].seconds > actualSpan)
+            actualSpan = threads[t].seconds;
+        filesFailed += threads[t].failed;
+        filesRetried += threads[t].retried;
+        free(threads[t].files);
+    }
+    printf("LPT: makespan predicted %.3fs, actual %.3fs\n", predictedSpan, actualSpan);
+    free(threads);
+    free(ids);
+    free(files);
+    return 0;
+}
+
+// a file or stream being decoded, or a free slot when fd is -1
+typedef struct EventFile {
+    int fd;
+    int pollable;               // watched by epoll rather than always ready
+    int ready;                  // epoll reported data since the last read
+    int attempts;
+    int stream;                 // ingest stream number, 0 for a file
+    long frame;                 // frames of the stream begun so far
+    double firstByte;           // when the current frame's data began
+    char src[TASK_PATH_MAX];
+    char dest[TASK_PATH_MAX];
+    ConvertProgressive decoder;
+} EventFile;
+
+typedef struct EventLoop {
+    int index;
+    long files;
+    long failed;
+    long retried;
+    long reads;
+    long long bytes;
+    long waits;                 // times it slept in epoll_wait
+    int peak;                   // most files in flight at once
+    long frames;                // ingested frames written,
+    double frameSeconds;        // their time from first byte to output
+    double tailSeconds;         // and from last byte to output
+} EventLoop;
+
+// next file of the folder for a free slot; 0 once there are none
+int eventNextFile(char* src, char* dest) {
+    struct dirent* entry;
+    pthread_mutex_lock(&eventLock);
+    while ((entry = readdir(eventDirectory)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || !strncmp(entry->d_name, "out_", 4))
+            continue;
+        snprintf(src, TASK_PATH_MAX, "%s/%s", eventFolder, entry->d_name);
+        snprintf(dest, TASK_PATH_MAX, "%s/out_%s", eventFolder, entry->d_name);
+        if (!skipFile(src))
+            break;
+    }
+    pthread_mutex_unlock(&eventLock);
+    return entry != NULL;
+}
+
+// watches f->fd when epoll can, and starts the decoder of its first image
+int eventWatch(int epoll, EventFile* f, int slot) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = slot};
+    f->pollable = epoll_ctl(epoll, EPOLL_CTL_ADD, f->fd, &ev) == 0;
+    f->ready = 0;
+    return convert_progressive_begin(&f->decoder, f->src, f->dest);
+}
+
+// opens f->src and starts its decoder; returns the conversion result
+// when that already fails
+int eventOpen(int epoll, EventFile* f, int slot) {
+    f->fd = open(f->src, O_RDONLY | O_NONBLOCK);
+    if (f->fd < 0)
+        return convert_fail(CONVERT_ERR_OPEN, "[open] %s", f->src);
+    return eventWatch(epoll, f, slot);
+}
+
+// names the next frame of an ingest stream
+void eventNextFrame(EventFile* f) {
+    f->frame++;
+    snprintf(f->src, sizeof(f->src), "%s#%d.%ld", strcmp(ingestSource, "-") ? ingestSource : "stdin", f->stream,
+             f->frame);
+    snprintf(f->dest, sizeof(f->dest), "%s/out_stream%d_%06ld.png", eventFolder, f->stream, f->frame);
+}
+
+// takes fd on as ingest stream number stream
+int eventAdopt(int epoll, EventFile* f, int slot, int fd) {
+    f->fd = fd;
+    f->stream = __atomic_add_fetch(&ingestStreams, 1, __ATOMIC_RELAXED);
+    f->frame = 0;
+    eventNextFrame(f);
+    return eventWatch(epoll, f, slot);
+}
+
+// ends f's conversion with rc, or retries it when rc is transient;
+// returns 1 when the slot is free again. A stream ends with the frame it
+// was in the middle of, if any.
+int eventClose(int epoll, EventLoop* loop, EventFile* f, int slot, int rc) {
+    if (f->fd >= 0) {
+        if (f->pollable)
+            epoll_ctl(epoll, EPOLL_CTL_DEL, f->fd, NULL);
+        close(f->fd);
+        f->fd = -1;
+    }
+    convert_progressive_free(&f->decoder, 0);
+    if (f->stream) {
+        if (rc != CONVERT_OK) {
+            loop->failed++;
+            reportFailure(f->src, rc, convert_context()->error);
+        }
+        f->stream = 0;
+        return 1;
+    }
+    journalDone(f->src, rc);
+    if (rc != CONVERT_OK && convert_error_transient(rc) && f->attempts < retryLimit && !stopRequested) {
+        f->attempts++;
+        loop->retried++;
+        journalStart(f->src);
+        if ((rc = eventOpen(epoll, f, slot)) == CONVERT_OK)
+            return 0;
+        return eventClose(epoll, loop, f, slot, rc);
+    }
+    if (rc != CONVERT_OK) {
+        loop->failed++;
+        reportFailure(f->src, rc, convert_context()->error);
+    }
+    loop->files++;
+    return 1;
+}
+
+// one read of a ready file or stream, fed to its decoder; returns 1 when
+// that finished it and freed its slot. On a stream, each image that ends
+// is written and the bytes after it begin the next.
+int eventRead(int epoll, EventLoop* loop, EventFile* f, int slot, unsigned char* buf) {
+    ssize_t len = read(f->fd, buf, EVENT_READ_SIZE);
+    f->ready = 0;
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (len < 0)
+        return eventClose(epoll, loop, f, slot, convert_fail(CONVERT_ERR_OPEN, "[read] %s", f->src));
+    double now = wall_seconds();
+    loop->reads++;
+    loop->bytes += len;
+    if (len == 0) {
+        // end of the file, or of a stream between two images
+        if (f->stream && f->decoder.bytes == 0)
+            return eventClose(epoll, loop, f, slot, CONVERT_OK);
+        return eventClose(epoll, loop, f, slot, convert_progressive_finish(&f->decoder));
+    }
+    unsigned char* data = buf;
+    while (len > 0) {
+        if (f->decoder.bytes == 0)
+            f->firstByte = now;
+        int rc = convert_progressive_feed(&f->decoder, data, len);
+        if (rc == CONVERT_OK && !f->decoder.done)
+            return 0;
+        if (rc == CONVERT_OK)
+            rc = convert_progressive_finish(&f->decoder);
+        if (!f->stream || rc != CONVERT_OK)
+            return eventClose(epoll, loop, f, slot, rc);
+        double written = wall_seconds();
+        loop->frames++;
+        loop->frameSeconds += written - f->firstByte;
+        loop->tailSeconds += written - now;
+        data += len - f->decoder.unused;
+        len = f->decoder.unused;
+        convert_progressive_free(&f->decoder, 0);
+        eventNextFrame(f);
+        if ((rc = convert_progressive_begin(&f->decoder, f->src, f->dest)) != CONVERT_OK)
+            return eventClose(epoll, loop, f, slot, rc);
+    }
+    return 0;
+}
+
+void* eventLoop(void* args) {
+    EventLoop* loop = args;
+    EventFile* files = calloc(eventInFlight, sizeof(*files));
+    struct epoll_event* events = malloc((eventInFlight + 1) * sizeof(*events));
+    unsigned char* buf = malloc(EVENT_READ_SIZE);
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int inFlight = 0, more = 1, listening = 0;
+    if (!files || !events || !buf || epoll < 0) {
+        perror("event loop");
+        free(files);
+        free(events);
+        free(buf);
+        return NULL;
+    }
+    pinWorker(loop->index);
+    for (int i = 0; i < eventInFlight; i++)
+        files[i].fd = -1;
+    while ((more || inFlight || ingestListen >= 0 || __atomic_load_n(&ingestFd, __ATOMIC_RELAXED) >= 0) &&
+           !stopRequested) {
+        // free slots go to ingest streams first, then to the folder
+        for (int i = 0; i < eventInFlight && !stopRequested; i++) {
+            EventFile* f = &files[i];
+            if (f->fd >= 0)
+                continue;
+            int fd = __atomic_exchange_n(&ingestFd, -1, __ATOMIC_RELAXED);
+            if (fd < 0 && ingestListen >= 0 && (fd = accept(ingestListen, NULL, NULL)) >= 0)
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+            int rc;
+            if (fd >= 0) {
+                rc = eventAdopt(epoll, f, i, fd);
+            } else if (more && (more = eventNextFile(f->src, f->dest))) {
+                f->attempts = 0;
+                journalStart(f->src);
+                rc = eventOpen(epoll, f, i);
+            } else {
+                break;
+            }
+            // a failed open may be retried at once, which keeps the slot
+            if (rc == CONVERT_OK || !eventClose(epoll, loop, f, i, rc))
+                inFlight++;
+        }
+        if (inFlight > loop->peak)
+            loop->peak = inFlight;
+
+        // the listening socket wakes the loop only while it has room
+        int room = inFlight < eventInFlight && ingestListen >= 0;
+        if (room != listening) {
+            struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.u32 = eventInFlight};
+            if (epoll_ctl(epoll, room ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ingestListen, &ev) == 0)
+                listening = room;
+        }
+
+        // sleep only when everything open waits on epoll
+        int always = 0;
+        for (int i = 0; i < eventInFlight; i++)
+            if (files[i].fd >= 0 && !files[i].pollable)
+                always++;
+        if (always < inFlight || listening) {
+            if (!always)
+                loop->waits++;
+            int got = epoll_wait(epoll, events, eventInFlight + 1, always ? 0 : EVENT_WAIT_MS);
+            for (int e = 0; e < got; e++)
+                if (events[e].data.u32 < (unsigned)eventInFlight)
+                    files[events[e].data.u32].ready = 1;
+        }
+        for (int i = 0; i < eventInFlight && !stopRequested; i++) {
+            EventFile* f = &files[i];
+            if (f->fd >= 0 && (!f->pollable || f->ready) && eventRead(epoll, loop, f, i, buf))
+                inFlight--;
+        }
+    }
+    // files cut off by a stop keep only their start line in the journal
+    for (int i = 0; i < eventInFlight; i++) {
+        if (files[i].fd >= 0) {
+            close(files[i].fd);
+            __atomic_add_fetch(&filesDropped, 1, __ATOMIC_RELAXED);
+        }
+        convert_progressive_free(&files[i].decoder, 1);
+    }
+    close(epoll);
+    free(files);
+    free(events);
+    free(buf);
+    return NULL;
+}
 
+// opens --ingest's source: standard input or a FIFO as the one stream,
+// anything else as a Unix socket to listen on
+int openIngest(const char* source) {
+    struct stat st;
+    if (strcmp(source, "-") == 0) {
+        ingestFd = dup(STDIN_FILENO);
+        return ingestFd < 0 || fcntl(ingestFd, F_SETFL, O_NONBLOCK) ? -1 : 0;
+    }
+    if (stat(source, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        ingestFd = open(source, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        return ingestFd < 0 ? -1 : 0;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(source) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    strcpy(addr.sun_path, source);
+    // a socket left behind by an earlier run
+    if (stat(source, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(source);
+    ingestListen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ingestListen < 0)
+        return -1;
+    if (bind(ingestListen, (struct sockaddr*)&addr, sizeof(addr)) || listen(ingestListen, 16)) {
+        close(ingestListen);
+        ingestListen = -1;
+        return -1;
+    }
+    printf("Ingest: listening on %s until SIGINT or SIGTERM\n", source);
+    return 0;
+}
+
+int event_solution(DIR* directory, int n, const char* folderName) {
+    if (n < 1)
+        n = 1;
+    eventDirectory = directory;
+    eventFolder = folderName;
+    if (ingestSource && openIngest(ingestSource)) {
+        perror(ingestSource);
+        return -1;
+    }
+    EventLoop* loops = calloc(n, sizeof(*loops));
+    pthread_t* ids = malloc(n * sizeof(*ids));
+    int started = 0;
+    for (; started < n; started++) {
+        loops[started].index = started;
+        if (pthread_create(&ids[started], NULL, eventLoop, &loops[started]) != 0) {
+            perror("Failed to create the thread");
+            break;
+        }
+    }
+    if (started == 0)
+        eventLoop(&loops[0]);
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+
+    long files = 0, reads = 0, waits = 0, frames = 0;
+    long long bytes = 0;
+    double frameSeconds = 0, tailSeconds = 0;
+    int peak = 0;
+    for (int t = 0; t < n; t++) {
+        files += loops[t].files;
+        reads += loops[t].reads;
+        waits += loops[t].waits;
+        bytes += loops[t].bytes;
+        frames += loops[t].frames;
+        frameSeconds += loops[t].frameSeconds;
+        tailSeconds += loops[t].tailSeconds;
+        if (loops[t].peak > peak)
+            peak = loops[t].peak;
+        filesFailed += loops[t].failed;
+        filesRetried += loops[t].retried;
+    }
+    printf("Event loops: %ld files on %d threads, at most %d in flight on one; %ld reads of %.1f KB mean, "
+           "%ld waits in epoll\n",
+           files, started ? started : 1, peak, reads, reads ? bytes / 1024.0 / reads : 0, waits);
+    if (ingestSource)
+        printf("Ingest: %ld frames from %d streams; %.2f ms mean from first byte to output, %.2f ms after the "
+               "last byte\n",
+               frames, ingestStreams, frames ? 1e3 * frameSeconds / frames : 0,
+               frames ? 1e3 * tailSeconds / frames : 0);
+    if (ingestListen >= 0) {
+        close(ingestListen);
+        unlink(ingestSource);
+    }
+    free(loops);
+    free(ids);
+    return 0;
 }
 
 // thread method protects the concurrency by using the semaphore to track
@@ -249,89 +2541,598 @@ void thread_method(char* args[]) {
     sem_wait(&semaphore);
 
     // run color convert on file
-    colorConvert(3 , args);
+    journalStart(args[1]);
+    int rc = colorConvert(3 , args);
+    journalDone(args[1], rc);
+    if (rc != CONVERT_OK) {
+        __atomic_add_fetch(&filesFailed, 1, __ATOMIC_RELAXED);
+        reportFailure(args[1], rc, convert_context()->error);
+    }
 
     //up the semaphore
     sem_post(&semaphore);
 }
 
-// proceses solution uses a shared memory int to track the number of child 
-// processes currently active. The method will fork children to run the 
-// colorConvert method but will block if the number of current children 
-// exceeds the user defined amount 
-void process_solution(DIR* directory, int n, char* folderName, int num_process) {
+// process solution: n worker processes are forked once and pull jobs from
+// rings in System V shared memory, so no file pays for a fork. Each ring is
+// guarded by process-shared semaphores (free entries, queued entries and a
+// lock on head and tail). In pt mode every process runs several threads
+// on the same rings, which keeps thread-level efficiency while a crash
+// only takes down that process's threads.
+//
+// Each thread records the job it is running. When a process dies, the
+// parent forks a replacement in the same slot and puts that process's
+// in-flight jobs back at the front of their ring. A requeued job runs in a
+// child of its own, so if it is the one that crashes, it alone is lost.
+// One still in flight when its process dies a third time is dropped.
+//
+// With --split=D the first D processes only decode and the rest only
+// encode. Decoded pixels never travel between them: a decoder fills one of
+// the slots of a memfd mapped shared before the fork and hands the encoder
+// just the slot number and image header.
+#define JOB_RING_SIZE 64
+#define MAX_WORKER_PROCESSES 256    // also the most threads over all processes
 
-    // create shared token
-    int sh_id = shmget(KEY, sizeof(int), IPC_CREAT | 0666);
-    if (sh_id < 0)
-        perror("shmget");
+typedef struct RingSync {
+    sem_t space;                // free entries
+    sem_t items;                // queued entries
+    sem_t lock;                 // guards head and tail
+    unsigned head;              // next entry to take
+    unsigned tail;              // next free entry
+} RingSync;
 
-    // attach token to parent process
-    int* process_count;
-    process_count = shmat(sh_id, NULL, 0);
-    process_count = n;
+typedef struct ProcessJob {
+    char src[TASK_PATH_MAX];    // empty: the thread should exit
+    char dest[TASK_PATH_MAX];
+    int attempts;               // times it was in flight when its process died
+} ProcessJob;
 
-    // while there are more files to read
-    struct dirent *directory_ent;
-    while ((directory_ent = readdir(directory)) != NULL)
-    {     
-        // if processes are all used block
-        while (process_count < 0)
-        {
-            //wait until there is an available
+// a decoded image waiting in a shared slot; slot -1 tells an encoder
+// thread to exit
+typedef struct Handoff {
+    int slot;
+    ConvertImage image;
+    ProcessJob job;
+} Handoff;
+
+typedef struct JobRing {
+    RingSync jobSync;
+    ProcessJob jobs[JOB_RING_SIZE];
+    RingSync handoffSync;
+    Handoff handoffs[JOB_RING_SIZE];
+    RingSync slotSync;
+    int freeSlots[JOB_RING_SIZE];
+    int failed;                 // files given up on
+    int threads;                // threads per process
+    int decoders;               // processes [0, decoders) decode; 0 unless split
+    size_t slotSize;
+    int stops[MAX_WORKER_PROCESSES];            // stop entries process i took
+    // thread t of process i is running[i * threads + t] while busy; its
+    // slot is the shared slot the thread owns, or -1
+    int busy[MAX_WORKER_PROCESSES];
+    Handoff running[MAX_WORKER_PROCESSES];
+} JobRing;
+
+int splitDecoders = 0;          // --split: decoder processes, 0 for none
+int processThreads = 4;         // --threads: threads per process in pt mode
+unsigned char* slotBase = NULL; // the memfd's slots, mapped shared
+
+void ringInit(RingSync* r, unsigned queued) {
+    sem_init(&r->space, 1, JOB_RING_SIZE - queued);
+    sem_init(&r->items, 1, queued);
+    sem_init(&r->lock, 1, 1);
+    r->head = 0;
+    r->tail = queued;
+}
+
+void ringDestroy(RingSync* r) {
+    sem_destroy(&r->space);
+    sem_destroy(&r->items);
+    sem_destroy(&r->lock);
+}
+
+void semWaitRetry(sem_t* s) {
+    while (sem_wait(s) != 0)
+        ;
+}
+
+// waits for a queued entry and returns its index with the lock held;
+// ringTakeEnd releases it once the entry has been copied out
+unsigned ringTakeBegin(RingSync* r) {
+    semWaitRetry(&r->items);
+    semWaitRetry(&r->lock);
+    return r->head++ % JOB_RING_SIZE;
+}
+
+void ringTakeEnd(RingSync* r) {
+    sem_post(&r->lock);
+    sem_post(&r->space);
+}
+
+// same for adding an entry, once space has been taken from r->space
+unsigned ringPutBegin(RingSync* r) {
+    semWaitRetry(&r->lock);
+    return r->tail++ % JOB_RING_SIZE;
+}
+
+// adds the entry in front of everything queued, so it is taken next
+unsigned ringPutFrontBegin(RingSync* r) {
+    semWaitRetry(&r->lock);
+    return --r->head % JOB_RING_SIZE;
+}
+
+void ringPutEnd(RingSync* r) {
+    sem_post(&r->lock);
+    sem_post(&r->items);
+}
+
+void releaseSlot(JobRing* ring, int slot) {
+    semWaitRetry(&ring->slotSync.space);
+    ring->freeSlots[ringPutBegin(&ring->slotSync)] = slot;
+    ringPutEnd(&ring->slotSync);
+}
+
+// counts and logs a job that failed with rc, if it did
+void jobFailed(JobRing* ring, const char* src, int rc) {
+    if (rc == CONVERT_OK)
+        return;
+    __atomic_add_fetch(&ring->failed, 1, __ATOMIC_RELAXED);
+    reportFailure(src, rc, convert_context()->error);
+}
+
+// decoder half of a split job: decode into a free slot and pass it on
+int decodeJob(JobRing* ring, int id, const ProcessJob* job) {
+    int slot = ring->freeSlots[ringTakeBegin(&ring->slotSync)];
+    ringTakeEnd(&ring->slotSync);
+    ring->running[id].slot = slot;
+
+    ConvertBuffer buffer = {
+        .pixels = slotBase + slot * ring->slotSize, .size = ring->slotSize, .external = 1
+    };
+    ConvertImage image;
+    png_bytep* rows;
+    convert_watch_begin(convert_context());
+    int rc = convert_decode_gray(convert_context(), job->src, &buffer, &image, &rows);
+    convert_watch_end(convert_context());
+    free(buffer.rows);
+    if (rc != CONVERT_OK) {
+        ring->running[id].slot = -1;
+        releaseSlot(ring, slot);
+        if (rc != CONVERT_ERR_TOO_BIG)
+            return rc;
+        // bigger than a slot (the folder changed after the scan): do it here
+        char* args[] = {"./colorConvert", (char*)job->src, (char*)job->dest};
+        return colorConvert(3, args);
+    }
+    // from here the encoder owns the slot; a crash in between leaks it
+    // rather than handing it out twice
+    ring->running[id].slot = -1;
+    semWaitRetry(&ring->handoffSync.space);
+    Handoff* h = &ring->handoffs[ringPutBegin(&ring->handoffSync)];
+    h->slot = slot;
+    h->image = image;
+    h->job = *job;
+    ringPutEnd(&ring->handoffSync);
+    return CONVERT_OK;
+}
+
+int encodeSlot(JobRing* ring, const Handoff* h) {
+    ConvertBuffer buffer = {
+        .pixels = slotBase + h->slot * ring->slotSize, .size = ring->slotSize, .external = 1
+    };
+    png_bytep* rows = convert_buffer_rows(&buffer, h->image.height, convert_row_stride(&h->image));
+    convert_watch_begin(convert_context());
+    int rc = convert_encode(convert_context(), h->job.dest, rows, &h->image);
+    convert_watch_end(convert_context());
+    free(buffer.rows);
+    return rc;
+}
+
+int runJob(JobRing* ring, int id, const ProcessJob* job) {
+    if (ring->decoders)
+        return decodeJob(ring, id, job);
+    char* args[] = {"./colorConvert", (char*)job->src, (char*)job->dest};
+    return colorConvert(3, args);
+}
+
+// runs a job that was in flight during a crash in a child of its own, so
+// that if it is what crashed, nothing else goes down with it. Returns 0
+// when the child ran the job to the end, having logged any failure;
+// otherwise the crash is reported and logged, and a slot the child was
+// decoding into is given back.
+int runIsolated(JobRing* ring, int id, int encoder) {
+    int status;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // lines buffered by the parent are its to write, and another of its
+        // threads may have held the lock when it forked
+        pthread_mutex_init(&journalLock, NULL);
+        journalLen = journalLines = 0;
+        const char* src = ring->running[id].job.src;
+        int rc = encoder ? encodeSlot(ring, &ring->running[id]) : runJob(ring, id, &ring->running[id].job);
+        jobFailed(ring, src, rc);
+        if (encoder || !ring->decoders || rc != CONVERT_OK)
+            journalDone(src, rc);
+        journalSync();
+        _Exit(EXIT_SUCCESS);
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+        return 0;
+    fprintf(stderr, "%s failed again on its own; skipping it\n", ring->running[id].job.src);
+    __atomic_add_fetch(&ring->failed, 1, __ATOMIC_RELAXED);
+    logFailure(ring->running[id].job.src, "crash", "crashed its worker, then again on its own");
+    quarantineFile(ring->running[id].job.src, "crash");
+    if (!encoder && ring->running[id].slot >= 0) {
+        releaseSlot(ring, ring->running[id].slot);
+        ring->running[id].slot = -1;
+    }
+    return -1;
+}
+
+// encoder thread: writes handed-off slots until told to exit
+void encodeLoop(JobRing* ring, int worker, int id) {
+    while (1) {
+        Handoff h = ring->handoffs[ringTakeBegin(&ring->handoffSync)];
+        ringTakeEnd(&ring->handoffSync);
+        if (h.slot < 0) {
+            __atomic_add_fetch(&ring->stops[worker], 1, __ATOMIC_ACQ_REL);
+            break;
         }
 
-        // child pid
-        pid_t cpid;
-        
-        // fork a child
-        if((cpid = fork()) < 0){ //create and check child
-            perror("Fork Error");
+        ring->running[id] = h;
+        __atomic_store_n(&ring->busy[id], 1, __ATOMIC_RELEASE);
+        if (h.job.attempts == 0) {
+            int rc = encodeSlot(ring, &h);
+            jobFailed(ring, h.job.src, rc);
+            journalDone(h.job.src, rc);
+        } else
+            runIsolated(ring, id, 1);
+        __atomic_store_n(&ring->busy[id], 0, __ATOMIC_RELEASE);
+        ring->running[id].slot = -1;
+        releaseSlot(ring, h.slot);
+    }
+}
+
+// job thread: converts (or, when split, decodes) jobs until it gets an
+// empty one
+void jobLoop(JobRing* ring, int worker, int id) {
+    ProcessJob job;
+    while (1) {
+        job = ring->jobs[ringTakeBegin(&ring->jobSync)];
+        ringTakeEnd(&ring->jobSync);
+        if (job.src[0] == '\0') {
+            __atomic_add_fetch(&ring->stops[worker], 1, __ATOMIC_ACQ_REL);
+            break;
         }
 
-        //in child
-        if(cpid == 0){ 
+        ring->running[id].job = job;
+        __atomic_store_n(&ring->busy[id], 1, __ATOMIC_RELEASE);
+        journalStart(job.src);
+        if (job.attempts == 0) {
+            // a split job is done once its encoder has written it
+            int rc = runJob(ring, id, &job);
+            jobFailed(ring, job.src, rc);
+            if (!ring->decoders || rc != CONVERT_OK)
+                journalDone(job.src, rc);
+        } else
+            runIsolated(ring, id, 0);
+        __atomic_store_n(&ring->busy[id], 0, __ATOMIC_RELEASE);
+    }
+}
 
-            // attach shared memory to child
-            int* semaphore = shmat(sh_id, NULL, 0);
-            if (semaphore < 0) 
-                perror("c_data");
+typedef struct WorkerThread {
+    JobRing* ring;
+    int worker;                 // process slot
+    int id;                     // index into busy and running
+} WorkerThread;
 
-            // down the semaphore in new as new process is created 
-            semaphore--;
+void* workerThread(void* args) {
+    WorkerThread* w = args;
+    pinWorker(w->id);
+    if (w->ring->decoders && w->worker >= w->ring->decoders)
+        encodeLoop(w->ring, w->worker, w->id);
+    else
+        jobLoop(w->ring, w->worker, w->id);
+    return NULL;
+}
+
+// worker process main: its threads run until each has taken a stop entry
+void processWorker(JobRing* ring, int worker) {
+    WorkerThread threads[MAX_WORKER_PROCESSES];
+    pthread_t th[MAX_WORKER_PROCESSES];
+    // the parent decides when to stop, and takes back the jobs not started
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    for (int t = 0; t < ring->threads; t++) {
+        threads[t] = (WorkerThread){ring, worker, worker * ring->threads + t};
+        if (t > 0 && pthread_create(&th[t], NULL, workerThread, &threads[t]) != 0) {
+            perror("Failed to create the thread");
+            _Exit(EXIT_FAILURE);
+        }
+    }
+    workerThread(&threads[0]);
+    for (int t = 1; t < ring->threads; t++)
+        pthread_join(th[t], NULL);
+    journalSync();
+    _Exit(EXIT_SUCCESS);
+}
+
+pid_t startWorkerProcess(JobRing* ring, int worker) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        perror("Fork Error");
+    else if (pid == 0)
+        processWorker(ring, worker);
+    return pid;
+}
 
-            //if parent dir or current dir skip
-            if (!strcmp(directory_ent->d_name, ".") || !strcmp(directory_ent->d_name, ".."))
+// puts the work a dead thread had in flight back at the front of its
+// ring, or drops it when it already survived two crashes
+void requeueRunning(JobRing* ring, int worker, int id) {
+    Handoff* h = &ring->running[id];
+    int encoder = ring->decoders && worker >= ring->decoders;
+    if (!ring->busy[id]) {
+        if (h->slot >= 0)
+            releaseSlot(ring, h->slot);
+        h->slot = -1;
+        return;
+    }
+    ring->busy[id] = 0;
+    if (h->job.attempts > 1) {
+        fprintf(stderr, "giving up on %s after it was in flight during three crashes\n", h->job.src);
+        ring->failed++;
+        logFailure(h->job.src, "crash", "in flight during three worker crashes");
+        quarantineFile(h->job.src, "crash");
+        if (h->slot >= 0)
+            releaseSlot(ring, h->slot);
+    } else if (encoder) {
+        // the decoded image is still in its slot: hand it out again
+        semWaitRetry(&ring->handoffSync.space);
+        Handoff* entry = &ring->handoffs[ringPutFrontBegin(&ring->handoffSync)];
+        *entry = *h;
+        entry->job.attempts++;
+        ringPutEnd(&ring->handoffSync);
+    } else {
+        if (h->slot >= 0)
+            releaseSlot(ring, h->slot);
+        semWaitRetry(&ring->jobSync.space);
+        ProcessJob* entry = &ring->jobs[ringPutFrontBegin(&ring->jobSync)];
+        *entry = h->job;
+        entry->attempts++;
+        ringPutEnd(&ring->jobSync);
+    }
+    h->slot = -1;
+}
+
+// reaps one worker if any exited (blocking when wait is set); a worker
+// that did not exit cleanly is reported and replaced, and its in-flight
+// jobs requeued. Returns 1 when a worker was reaped.
+int reapWorkerProcess(JobRing* ring, pid_t* workers, int n, int wait, int* restarts) {
+    int status;
+    pid_t pid = waitpid(-1, &status, wait ? 0 : WNOHANG);
+    if (pid <= 0)
+        return 0;
+    int worker;
+    for (worker = 0; worker < n && workers[worker] != pid; worker++)
+        ;
+    if (worker == n)
+        return 1;
+    workers[worker] = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+        return 1;
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "worker %d died from signal %d", (int)pid, WTERMSIG(status));
+    else
+        fprintf(stderr, "worker %d exited with status %d", (int)pid, WEXITSTATUS(status));
+    for (int t = 0; t < ring->threads; t++) {
+        int id = worker * ring->threads + t;
+        if (ring->busy[id])
+            fprintf(stderr, "%s %s", t ? "," : " while converting", ring->running[id].job.src);
+    }
+    fprintf(stderr, "; restarting it\n");
+
+    // the replacement must be running before anything is requeued, so a
+    // full ring always has a consumer. It needs a stop entry per thread,
+    // so those its predecessor's threads took go back too.
+    int stops = ring->stops[worker];
+    ring->stops[worker] = 0;
+    workers[worker] = startWorkerProcess(ring, worker);
+    (*restarts)++;
+    for (int t = 0; t < ring->threads; t++)
+        requeueRunning(ring, worker, worker * ring->threads + t);
+    int encoder = ring->decoders && worker >= ring->decoders;
+    for (int i = 0; i < stops; i++) {
+        if (encoder) {
+            semWaitRetry(&ring->handoffSync.space);
+            ring->handoffs[ringPutBegin(&ring->handoffSync)].slot = -1;
+            ringPutEnd(&ring->handoffSync);
+        } else {
+            semWaitRetry(&ring->jobSync.space);
+            ring->jobs[ringPutBegin(&ring->jobSync)].src[0] = '\0';
+            ringPutEnd(&ring->jobSync);
+        }
+    }
+    return 1;
+}
+
+// takes space in r for the parent, reaping (and replacing) crashed workers
+// while it waits so a dead pool cannot block it; returns the entry index
+// with the lock held, for ringPutEnd
+unsigned parentPutBegin(JobRing* ring, RingSync* r, pid_t* workers, int n, int* restarts) {
+    while (1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 50 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        if (sem_timedwait(&r->space, &ts) == 0)
+            break;
+        while (reapWorkerProcess(ring, workers, n, 0, restarts))
+            ;
+    }
+    return ringPutBegin(r);
+}
+
+// size of a slot: the largest decoded image in the folder
+size_t largestImage(DIR* directory, const char* folderName) {
+    struct dirent *directory_ent;
+    size_t largest = 0;
+    while ((directory_ent = readdir(directory)) != NULL) {
+        char path[TASK_PATH_MAX];
+        ConvertImage image;
+        if (directory_ent->d_name[0] == '.' || !strncmp(directory_ent->d_name, "out_", 4))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", folderName, directory_ent->d_name);
+        // images over the limits are refused before they reach a slot
+        if (convert_peek_header(path, &image, NULL) || !convert_within_limits(image.width, image.height))
             continue;
+        size_t size = convert_row_stride(&image) * image.height;
+        ConvertImage rgb = image;
+        rgb.bit_depth = 8;
+        rgb.color_type = PNG_COLOR_TYPE_RGB;
+        if (convert_row_stride(&rgb) * image.height > size)
+            size = convert_row_stride(&rgb) * image.height;
+        if (size > largest)
+            largest = size;
+    }
+    rewinddir(directory);
+    return largest;
+}
 
-            //input file name creation
-            char dest[50], src[50];
-            char* fileName = directory_ent->d_name;
-            
-            strcpy(src, "images/");
-            strcat(src , fileName);
+int countRunning(pid_t* workers, int from, int to) {
+    int running = 0;
+    for (int i = from; i < to; i++)
+        running += workers[i] > 0;
+    return running;
+}
 
-            //output file name creation
-            strcpy(dest, "images/");
-            strcat(dest, "out_");
-            strcat(dest, fileName);
+// n processes of threads threads each: 1 for p mode
+void process_solution(DIR* directory, int n, const char* folderName, int threads) {
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKER_PROCESSES)
+        n = MAX_WORKER_PROCESSES;
+    if (threads < 1)
+        threads = 1;
+    if (n * threads > MAX_WORKER_PROCESSES)
+        threads = MAX_WORKER_PROCESSES / n;
+    int decoders = splitDecoders;
+    if (decoders && (n < 2 || decoders >= n)) {
+        fprintf(stderr, "--split needs fewer decoders than the %d processes; not splitting\n", n);
+        decoders = 0;
+    }
 
-            char* args[3];
-            args[0] = "./colorConvert";
-            args[1] = src;
-            args[2] = dest;
-            colorConvert(3 , args);  
+    // the segment is marked for removal right away; it lives until the
+    // last worker detaches, and never outlives the run
+    int sh_id = shmget(IPC_PRIVATE, sizeof(JobRing), IPC_CREAT | 0600);
+    if (sh_id < 0) {
+        perror("shmget");
+        return;
+    }
+    JobRing* ring = shmat(sh_id, NULL, 0);
+    shmctl(sh_id, IPC_RMID, NULL);
+    if (ring == (void*)-1) {
+        perror("shmat");
+        return;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ringInit(&ring->jobSync, 0);
+    ringInit(&ring->handoffSync, 0);
+    for (int i = 0; i < MAX_WORKER_PROCESSES; i++)
+        ring->running[i].slot = -1;
+    ring->threads = threads;
 
-            semaphore++;
-            _Exit(EXIT_SUCCESS);          
+    // slots: enough for every thread to hold one with a spare each
+    int slots = 0;
+    size_t mapped = 0;
+    if (decoders) {
+        size_t slotSize = (largestImage(directory, folderName) + 4095) & ~(size_t)4095;
+        slots = 2 * n * threads < JOB_RING_SIZE ? 2 * n * threads : JOB_RING_SIZE;
+        int fd = slotSize ? syscall(SYS_memfd_create, "colorConvert-slots", MFD_CLOEXEC) : -1;
+        mapped = slotSize * slots;
+        if (fd < 0 || ftruncate(fd, mapped) ||
+            (slotBase = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            perror("memfd slots; not splitting");
+            slotBase = NULL;
+            decoders = 0;
+            slots = 0;
         }
+        if (fd >= 0)
+            close(fd);
+        ring->slotSize = slotSize;
+        for (int i = 0; i < slots; i++)
+            ring->freeSlots[i] = i;
     }
-    // wait for all child processes to complete before returning
-    int wpid;
-    int rd = 0;
-    while ((wpid = wait(&rd)) > 0)
+    ringInit(&ring->slotSync, slots);
+    ring->decoders = decoders;
+
+    pid_t workers[MAX_WORKER_PROCESSES];
+    int restarts = 0;
+    for (int i = 0; i < n; i++)
+        workers[i] = startWorkerProcess(ring, i);
+
+    struct dirent *directory_ent;
+    while (!stopRequested && (directory_ent = readdir(directory)) != NULL)
     {
-        //do nothing and wait for all threads to return
+        //if parent dir or current dir skip, and don't convert outputs again
+        if (!strcmp(directory_ent->d_name, ".") || !strcmp(directory_ent->d_name, ".."))
+            continue;
+        if (!strncmp(directory_ent->d_name, "out_", 4))
+            continue;
+        char src[TASK_PATH_MAX];
+        snprintf(src, sizeof(src), "%s/%s", folderName, directory_ent->d_name);
+        if (skipFile(src))
+            continue;
+        ProcessJob* job = &ring->jobs[parentPutBegin(ring, &ring->jobSync, workers, n, &restarts)];
+        snprintf(job->src, sizeof(job->src), "%s", src);
+        snprintf(job->dest, sizeof(job->dest), "%s/out_%s", folderName, directory_ent->d_name);
+        job->attempts = 0;
+        ringPutEnd(&ring->jobSync);
+    }
+
+    // on a stop, take back the jobs no worker has started
+    while (stopRequested && sem_trywait(&ring->jobSync.items) == 0) {
+        semWaitRetry(&ring->jobSync.lock);
+        ring->jobSync.head++;
+        ringTakeEnd(&ring->jobSync);
+        filesDropped++;
     }
-    shmdt(sh_id);
-}
\ No newline at end of file
+
+    // one stop entry per job-taking thread, queued behind the last job;
+    // requeued jobs go in front of them. Encoders are stopped once every
+    // decoder is gone, behind the last handoff.
+    int takers = (decoders ? decoders : n) * threads;
+    for (int i = 0; i < takers; i++) {
+        ring->jobs[parentPutBegin(ring, &ring->jobSync, workers, n, &restarts)].src[0] = '\0';
+        ringPutEnd(&ring->jobSync);
+    }
+    if (decoders) {
+        while (countRunning(workers, 0, decoders) > 0 && reapWorkerProcess(ring, workers, n, 1, &restarts))
+            ;
+        for (int i = decoders * threads; i < n * threads; i++) {
+            ring->handoffs[parentPutBegin(ring, &ring->handoffSync, workers, n, &restarts)].slot = -1;
+            ringPutEnd(&ring->handoffSync);
+        }
+    }
+    while (countRunning(workers, 0, n) > 0 && reapWorkerProcess(ring, workers, n, 1, &restarts))
+        ;
+    if (decoders)
+        printf("Split: %d decoders, %d encoders, %d slots of %.1f MB\n", decoders, n - decoders, slots,
+               ring->slotSize / 1048576.0);
+    if (restarts)
+        printf("Worker processes restarted: %d\n", restarts);
+    filesFailed += ring->failed;
+
+    if (slotBase) {
+        munmap(slotBase, mapped);
+        slotBase = NULL;
+    }
+    ringDestroy(&ring->jobSync);
+    ringDestroy(&ring->handoffSync);
+    ringDestroy(&ring->slotSync);
+    shmdt(ring);
+}
@@ -0,0 +1,481 @@
+#!/bin/bash
+# Regression checks for the driver, run by `make check` or by hand from the
+# repository after `make driver`. Each check works on copies in a scratch
+# folder and prints ok or FAIL with the reason; the exit status is the
+# number of checks that failed. PNGs are generated and read back with
+# python3, standard library only.
+
+DRIVER=${DRIVER:-$PWD/driver}
+IMAGES=${IMAGES:-$PWD/images}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+ok() {
+    echo "ok   $1"
+}
+
+fail() {
+    echo "FAIL $1: $2"
+    failures=$((failures + 1))
+}
+
+# png.py pixels FILE...      a digest of each file's decoded samples
+# png.py gray SRC OUT        fails unless OUT is the 8 bit grayscale of SRC
+# png.py write FILE W H D    an RGB image of bit depth D with a text chunk,
+#                            stored rather than compressed
+# png.py header FILE W H     an image that only declares its size
+# png.py damage FILE         moves the second strip offset of FILE's restart
+#                            index (rsIX) by a byte, keeping its CRC valid
+cat > "$WORK/png.py" <<'EOF'
+import hashlib, struct, sys, zlib
+
+def chunk(kind, body):
+    return struct.pack('>I', len(body)) + kind + body + struct.pack('>I', zlib.crc32(kind + body))
+
+def save(path, width, height, depth, raw, extra=b''):
+    head = struct.pack('>IIBBBBB', width, height, depth, 2, 0, 0, 0)
+    with open(path, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', head) + extra + chunk(b'IDAT', raw) + chunk(b'IEND', b''))
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    return a if pa <= pb and pa <= pc else b if pb <= pc else c
+
+# width, height, bit depth and a tuple of RGB or RGBA samples per pixel
+def read(path):
+    data = open(path, 'rb').read()
+    if data[:8] != b'\x89PNG\r\n\x1a\n':
+        sys.exit(path + ': not a PNG')
+    pos, idat, plte = 8, b'', b''
+    while pos < len(data):
+        size, kind = struct.unpack('>I4s', data[pos:pos + 8])
+        body = data[pos + 8:pos + 8 + size]
+        if kind == b'IHDR':
+            width, height, depth, ctype, _, _, interlace = struct.unpack('>IIBBBBB', body)
+        elif kind == b'PLTE':
+            plte = body
+        elif kind == b'IDAT':
+            idat += body
+        elif kind == b'IEND':
+            break
+        pos += 12 + size
+    if interlace:
+        sys.exit(path + ': interlaced')
+    channels = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}[ctype]
+    bpp = max(1, channels * depth // 8)
+    stride = (width * channels * depth + 7) // 8
+    raw = zlib.decompress(idat)
+    prev, pixels = bytearray(stride), []
+    for y in range(height):
+        start = y * (stride + 1)
+        kind, row = raw[start], bytearray(raw[start + 1:start + 1 + stride])
+        for i in range(stride if kind else 0):
+            a = row[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            row[i] = (row[i] + (0, a, b, (a + b) // 2, paeth(a, b, c))[kind]) & 255
+        prev = row
+        if depth == 16:
+            samples = struct.unpack('>%dH' % (stride // 2), row)
+        elif depth == 8:
+            samples = row
+        else:
+            mask = (1 << depth) - 1
+            samples = [row[x * depth // 8] >> (8 - depth - x * depth % 8) & mask for x in range(width)]
+            if ctype == 0:
+                samples = [v * 255 // mask for v in samples]
+        for x in range(width):
+            s = samples[x * channels:(x + 1) * channels]
+            if ctype == 3:
+                pixels.append(tuple(plte[3 * s[0]:3 * s[0] + 3]))
+            elif ctype in (0, 4):
+                pixels.append((s[0],) * 3 + tuple(s[1:]))
+            else:
+                pixels.append(tuple(s))
+    return width, height, max(depth, 8), pixels
+
+command, args = sys.argv[1], sys.argv[2:]
+if command == 'pixels':
+    for path in args:
+        print(hashlib.sha1(repr(read(path)).encode()).hexdigest(), path)
+elif command == 'gray':
+    sw, sh, sd, src = read(args[0])
+    ow, oh, od, out = read(args[1])
+    if sd == 16:
+        sd, src = 8, [tuple(v >> 8 for v in p) for p in src]
+    if (sw, sh, sd) != (ow, oh, od):
+        sys.exit('%s: %dx%d at %d bits, from %dx%d at %d' % (args[1], ow, oh, od, sw, sh, sd))
+    for i, (p, q) in enumerate(zip(src, out)):
+        if q[:3] != (sum(p[:3]) // 3,) * 3:
+            sys.exit('%s: pixel %d is %s, from %s' % (args[1], i, q, p))
+elif command == 'write':
+    width, height, depth = map(int, args[1:])
+    top = (1 << depth) - 1
+    rows = []
+    for y in range(height):
+        samples = [(x * 37 + y * 11) * top // 255 % (top + 1) for x in range(width)]
+        samples = [v for s in samples for v in (s, top - s, s * y % (top + 1))]
+        rows.append(b'\0' + struct.pack('>%d%s' % (len(samples), 'H' if depth == 16 else 'B'), *samples))
+    save(args[0], width, height, depth, zlib.compress(b''.join(rows), 0),
+         chunk(b'tEXt', b'Comment\0' + b'regression ' * 40))
+elif command == 'header':
+    width, height = map(int, args[1:])
+    save(args[0], width, height, 8, zlib.compress(b'\0' * 1024))
+elif command == 'damage':
+    data = bytearray(open(args[0], 'rb').read())
+    pos = data.find(b'rsIX') - 4
+    if pos < 0 or struct.unpack('>I', data[pos + 13:pos + 17])[0] < 2:
+        sys.exit(args[0] + ': no restart index of two strips or more')
+    offset = pos + 8 + 9 + 4
+    data[offset:offset + 4] = struct.pack('>I', struct.unpack('>I', data[offset:offset + 4])[0] + 1)
+    size = struct.unpack('>I', data[pos:pos + 4])[0]
+    data[pos + 8 + size:pos + 12 + size] = struct.pack('>I', zlib.crc32(data[pos + 4:pos + 8 + size]))
+    open(args[0], 'wb').write(data)
+EOF
+
+png() {
+    python3 "$WORK/png.py" "$@"
+}
+
+# same pixels: the bytes, or failing that the decoded samples
+same_pixels() {
+    cmp -s "$1" "$2" || [ "$(png pixels "$1" | cut -d' ' -f1)" = "$(png pixels "$2" | cut -d' ' -f1)" ]
+}
+
+# a fresh folder with the repository's images and small generated ones:
+# rgb8.png, and rgb16.png for the 16 bit paths
+fill() {
+    rm -rf "$1"
+    mkdir -p "$1"
+    cp "$IMAGES"/*.png "$1"/
+    png write "$1/rgb8.png" 40 30 8
+    png write "$1/rgb16.png" 40 30 16
+}
+
+# the native codec writes the same images as libpng, and both write the
+# grayscale of the input, 16 bit ones included
+check_codecs() {
+    for codec in native libpng; do
+        fill "$WORK/$codec"
+        "$DRIVER" --codec=$codec 2 tp "$WORK/$codec" > "$WORK/$codec.log" 2>&1
+    done
+    for src in "$WORK"/native/*.png; do
+        name=$(basename "$src")
+        case $name in out_*) continue;; esac
+        if [ ! -f "$WORK/native/out_$name" ] || [ ! -f "$WORK/libpng/out_$name" ]; then
+            fail codecs "no output for $name"
+            return
+        fi
+        if ! same_pixels "$WORK/native/out_$name" "$WORK/libpng/out_$name"; then
+            fail codecs "native and libpng differ on $name"
+            return
+        fi
+    done
+    for out in "$WORK"/native/out_rgb8.png "$WORK"/native/out_rgb16.png "$WORK"/libpng/out_rgb16.png; do
+        if ! reason=$(png gray "$(dirname "$out")/$(basename "$out" | cut -c5-)" "$out" 2>&1); then
+            fail codecs "$reason"
+            return
+        fi
+    done
+    ok codecs
+}
+
+# the o post-pass only replaces a file with a smaller one of the same
+# pixels, and leaves 16 bit files as they are
+check_optimize() {
+    dir="$WORK/optimize"
+    mkdir -p "$dir"
+    png write "$dir/out_8.png" 40 30 8
+    png write "$dir/out_16.png" 40 30 16
+    cp "$WORK/native/out_rgb8.png" "$dir/out_gray.png"
+    mkdir -p "$WORK/before"
+    cp "$dir"/*.png "$WORK/before/"
+    "$DRIVER" 2 o "$dir" > "$WORK/optimize.log" 2>&1
+    if ! cmp -s "$dir/out_16.png" "$WORK/before/out_16.png"; then
+        fail optimize "out_16.png was rewritten"
+        return
+    fi
+    if [ "$(stat -c %s "$dir/out_8.png")" -ge "$(stat -c %s "$WORK/before/out_8.png")" ]; then
+        fail optimize "out_8.png did not shrink"
+        return
+    fi
+    for name in out_8.png out_gray.png; do
+        if ! same_pixels "$dir/$name" "$WORK/before/$name"; then
+            fail optimize "$name changed its pixels"
+            return
+        fi
+    done
+    ok optimize
+}
+
+# files given up on are logged with the class of their error, by the pool
+# and by the event loops alike
+check_failures() {
+    for mode in tp ev; do
+        dir="$WORK/failures_$mode"
+        mkdir -p "$dir"
+        png write "$dir/good.png" 40 30 8
+        png header "$dir/huge.png" 60000 60000
+        png write "$WORK/whole.png" 40 30 8
+        head -c 2000 "$WORK/whole.png" > "$dir/trunc.png"
+        echo "not an image" > "$dir/text.png"
+        "$DRIVER" --failure-log="$WORK/failures_$mode.log" 2 $mode "$dir" > "$WORK/failures_$mode.out" 2>&1
+        for expect in huge.png:limit trunc.png:corrupt text.png:format; do
+            if ! grep -q "^$dir/${expect%:*}	${expect#*:}	" "$WORK/failures_$mode.log"; then
+                fail failures "$mode did not log ${expect%:*} as ${expect#*:}"
+                return
+            fi
+        done
+        if grep -q "good.png" "$WORK/failures_$mode.log" || [ ! -f "$dir/out_good.png" ]; then
+            fail failures "$mode did not convert good.png"
+            return
+        fi
+    done
+    ok failures
+}
+
+# a run stopped by SIGINT and resumed from its journal skips exactly the
+# files journaled as done and converts the rest as an uninterrupted run would
+check_resume() {
+    dir="$WORK/resume"
+    mkdir -p "$dir"
+    for copy in a b; do
+        for src in "$IMAGES"/*.png; do
+            cp "$src" "$dir/${copy}_$(basename "$src")"
+        done
+    done
+    files=$(ls "$dir" | wc -l)
+    "$DRIVER" --journal="$WORK/journal" 1 tp "$dir" > "$WORK/resume1.log" 2>&1 &
+    for i in $(seq 100); do
+        grep -q "^done" "$WORK/journal" 2> /dev/null && break
+        sleep 0.1
+    done
+    kill -INT $!
+    wait $!
+    finished=$(grep -c "^done	.*	ok$" "$WORK/journal")
+    if [ "$finished" -eq 0 ] || [ "$finished" -ge "$files" ]; then
+        fail resume "$finished of $files files done when stopped"
+        return
+    fi
+    "$DRIVER" --journal="$WORK/journal" --resume 1 tp "$dir" > "$WORK/resume2.log" 2>&1
+    if ! grep -q "^Resume: skipped $finished files" "$WORK/resume2.log"; then
+        fail resume "expected $finished files skipped: $(grep Resume "$WORK/resume2.log")"
+        return
+    fi
+    for src in "$IMAGES"/*.png; do
+        name=$(basename "$src")
+        for copy in a b; do
+            if ! cmp -s "$dir/out_${copy}_$name" "$WORK/native/out_$name"; then
+                fail resume "out_${copy}_$name is missing or differs"
+                return
+            fi
+        done
+    done
+    ok resume
+}
+
+# images sent back to back down standard input or a FIFO come out as the
+# folder's files would
+check_ingest() {
+    frames=("$WORK/native/rgb8.png" "$WORK/native/rgb16.png" "$WORK/native/rgb8.png")
+    mkdir -p "$WORK/stdin" "$WORK/fifo"
+    cat "${frames[@]}" | "$DRIVER" --ingest=- 1 ev "$WORK/stdin" > "$WORK/stdin.log" 2>&1
+    mkfifo "$WORK/frames"
+    cat "${frames[@]}" > "$WORK/frames" &
+    "$DRIVER" --ingest="$WORK/frames" 1 ev "$WORK/fifo" > "$WORK/fifo.log" 2>&1
+    wait
+    for source in stdin fifo; do
+        for frame in 1 2 3; do
+            out="$WORK/$source/out_stream1_00000$frame.png"
+            name=$(basename "${frames[frame - 1]}")
+            if [ ! -f "$out" ] || ! same_pixels "$out" "$WORK/native/out_$name"; then
+                fail ingest "frame $frame from $source is missing or differs"
+                return
+            fi
+        done
+    done
+    ok ingest
+}
+
+# several folders run one after another through one pool, each reported
+# at its own latch once all of its files are done
+check_folders() {
+    fill "$WORK/first"
+    mkdir -p "$WORK/second"
+    cp "$WORK/native/rgb8.png" "$WORK/native/rgb16.png" "$WORK/second/"
+    files=$(ls "$WORK/first" | wc -l)
+    "$DRIVER" 2 tp "$WORK/first" "$WORK/second" > "$WORK/folders.log" 2>&1
+    if ! grep -q "^Batch 1: $WORK/first: $files files, 0 failed" "$WORK/folders.log" ||
+       ! grep -q "^Batch 2: $WORK/second: 2 files, 0 failed" "$WORK/folders.log"; then
+        fail folders "$(grep Batch "$WORK/folders.log")"
+        return
+    fi
+    for src in "$WORK"/first/[!o]*.png "$WORK"/second/[!o]*.png; do
+        name=$(basename "$src")
+        if ! cmp -s "$(dirname "$src")/out_$name" "$WORK/native/out_$name"; then
+            fail folders "out_$name is missing or differs"
+            return
+        fi
+    done
+    ok folders
+}
+
+# an image written with a restart index decodes the same in parallel
+# strips (tp) as in one go (lpt), and one whose index is damaged is read
+# again without it rather than written out as garbage
+check_restart() {
+    fill "$WORK/restart"
+    "$DRIVER" --restart-rows=4 2 tp "$WORK/restart" > "$WORK/restart.log" 2>&1
+    for mode in tp lpt; do
+        dir="$WORK/restart_$mode"
+        mkdir -p "$dir"
+        for out in "$WORK"/restart/out_*.png; do
+            cp "$out" "$dir/$(basename "$out" | cut -c5-)"
+        done
+        cp "$WORK/restart/out_rgb8.png" "$dir/damaged.png"
+        if ! reason=$(png damage "$dir/damaged.png" 2>&1); then
+            fail restart "$reason"
+            return
+        fi
+        "$DRIVER" 2 $mode "$dir" > "$WORK/restart_$mode.log" 2>&1
+    done
+    for src in "$WORK"/restart_tp/[!o]*.png; do
+        name=$(basename "$src")
+        if [ ! -f "$WORK/restart_tp/out_$name" ] || ! cmp -s "$WORK/restart_tp/out_$name" "$WORK/restart_lpt/out_$name"; then
+            fail restart "strips and sequential decode differ on $name"
+            return
+        fi
+    done
+    # the gray of a gray image is itself
+    for name in rgb8.png damaged.png; do
+        if ! same_pixels "$WORK/restart_tp/out_$name" "$WORK/restart/out_rgb8.png"; then
+            fail restart "$name did not decode to the pixels written"
+            return
+        fi
+    done
+    ok restart
+}
+
+# a worker process killed in the middle of a run is restarted and the files
+# it was converting are converted again
+check_crash() {
+    dir="$WORK/crash"
+    mkdir -p "$dir"
+    for copy in a b; do
+        for src in "$IMAGES"/*.png; do
+            cp "$src" "$dir/${copy}_$(basename "$src")"
+        done
+    done
+    "$DRIVER" --threads=2 2 pt "$dir" > "$WORK/crash.log" 2>&1 &
+    driver=$!
+    for i in $(seq 100); do
+        ls "$dir" | grep -q "^out_" && break
+        sleep 0.1
+    done
+    kill -KILL $(pgrep -P $driver | head -1)
+    wait $driver
+    if ! grep -q "restarting it" "$WORK/crash.log"; then
+        fail crash "no worker was restarted"
+        return
+    fi
+    for src in "$IMAGES"/*.png; do
+        name=$(basename "$src")
+        for copy in a b; do
+            if ! cmp -s "$dir/out_${copy}_$name" "$WORK/native/out_$name"; then
+                fail crash "out_${copy}_$name is missing or differs"
+                return
+            fi
+        done
+    done
+    ok crash
+}
+
+# processes split into decoders and encoders write what the pool writes
+check_split() {
+    fill "$WORK/split"
+    "$DRIVER" --split=1 3 p "$WORK/split" > "$WORK/split.log" 2>&1
+    if ! grep -q "^Split: 1 decoders" "$WORK/split.log"; then
+        fail split "the processes were not split"
+        return
+    fi
+    for src in "$WORK"/split/[!o]*.png; do
+        name=$(basename "$src")
+        if ! cmp -s "$WORK/split/out_$name" "$WORK/native/out_$name"; then
+            fail split "out_$name is missing or differs"
+            return
+        fi
+    done
+    ok split
+}
+
+# the longest-first static schedule writes what the pool writes
+check_lpt() {
+    fill "$WORK/lpt"
+    "$DRIVER" 2 lpt "$WORK/lpt" > "$WORK/lpt.log" 2>&1
+    for src in "$WORK"/lpt/[!o]*.png; do
+        name=$(basename "$src")
+        if ! cmp -s "$WORK/lpt/out_$name" "$WORK/native/out_$name"; then
+            fail lpt "out_$name is missing or differs"
+            return
+        fi
+    done
+    ok lpt
+}
+
+# files packed several to a task are converted as they are one at a time
+check_batch() {
+    fill "$WORK/batch"
+    "$DRIVER" --batch=4 2 tp "$WORK/batch" > "$WORK/batch.log" 2>&1
+    if ! grep -q "(batch size 4)" "$WORK/batch.log"; then
+        fail batch "$(grep Scheduling "$WORK/batch.log")"
+        return
+    fi
+    for src in "$WORK"/batch/[!o]*.png; do
+        name=$(basename "$src")
+        if ! cmp -s "$WORK/batch/out_$name" "$WORK/native/out_$name"; then
+            fail batch "out_$name is missing or differs"
+            return
+        fi
+    done
+    ok batch
+}
+
+# live frames shed under --overload=drop are each logged as shed, so every
+# frame is either converted or accounted for
+check_overload() {
+    fill "$WORK/backlog"
+    mkdir -p "$WORK/live"
+    for i in 1 2 3 4 5 6 7 8; do
+        png write "$WORK/live/frame$i.png" 40 30 8
+    done
+    "$DRIVER" --live="$WORK/live" --overload=drop --live-queue=2 --failure-log="$WORK/overload_failures.log" \
+        1 tp "$WORK/backlog" > "$WORK/overload.log" 2>&1
+    shed=$(grep -c "	shed	" "$WORK/overload_failures.log" 2> /dev/null)
+    if [ "${shed:-0}" -eq 0 ] || ! grep -q "^Overload: $shed live frames shed" "$WORK/overload.log"; then
+        fail overload "${shed:-0} frames logged as shed: $(grep Overload "$WORK/overload.log")"
+        return
+    fi
+    for i in 1 2 3 4 5 6 7 8; do
+        if [ ! -f "$WORK/live/out_frame$i.png" ] && ! grep -q "^$WORK/live/frame$i.png	shed	" "$WORK/overload_failures.log"; then
+            fail overload "frame$i.png was neither converted nor logged"
+            return
+        fi
+    done
+    ok overload
+}
+
+check_codecs
+check_restart
+check_optimize
+check_failures
+check_resume
+check_ingest
+check_folders
+check_crash
+check_split
+check_lpt
+check_batch
+check_overload
+exit $failures